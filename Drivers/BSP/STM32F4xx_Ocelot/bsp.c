@@ -346,6 +346,10 @@ static void BSP_Uart_Configure(void)
 {
   GPIO_InitTypeDef GPIO_InitStruct;
   
+  /* DMA controllers serving the uart rx/tx streams */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+  
 #if (BSP_USART1_ENABLED == BSP_ON)
   {
     /* Peripheral clock enable */
@@ -366,6 +370,14 @@ static void BSP_Uart_Configure(void)
     HAL_NVIC_SetPriority(USART1_IRQn, 6, 0);
     HAL_NVIC_EnableIRQ(USART1_IRQn);
     HAL_NVIC_ClearPendingIRQ(USART1_IRQn);
+
+    /* rx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART1_RX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART1_RX_DMA_IRQn);
+
+    /* tx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART1_TX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART1_TX_DMA_IRQn);
   }
 #endif
   
@@ -398,6 +410,14 @@ static void BSP_Uart_Configure(void)
     HAL_NVIC_SetPriority(USART3_IRQn, 6, 0);
     HAL_NVIC_EnableIRQ(USART3_IRQn);
     HAL_NVIC_ClearPendingIRQ(USART3_IRQn);
+
+    /* rx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART3_RX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART3_RX_DMA_IRQn);
+
+    /* tx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART3_TX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART3_TX_DMA_IRQn);
   }
 #endif
   
@@ -421,6 +441,14 @@ static void BSP_Uart_Configure(void)
     HAL_NVIC_SetPriority(USART6_IRQn, 6, 0);
     HAL_NVIC_EnableIRQ(USART6_IRQn);
     HAL_NVIC_ClearPendingIRQ(USART6_IRQn);
+
+    /* rx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART6_RX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART6_RX_DMA_IRQn);
+
+    /* tx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_USART6_TX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_USART6_TX_DMA_IRQn);
   }
 #endif
 
@@ -444,6 +472,10 @@ static void BSP_Uart_Configure(void)
     HAL_NVIC_SetPriority(UART7_IRQn, 6, 0);
     HAL_NVIC_EnableIRQ(UART7_IRQn);
     HAL_NVIC_ClearPendingIRQ(UART7_IRQn);
+
+    /* rx dma stream interrupt init */
+    HAL_NVIC_SetPriority(BSP_UART7_RX_DMA_IRQn, 6, 0);
+    HAL_NVIC_EnableIRQ(BSP_UART7_RX_DMA_IRQn);
   }
 #endif
 }
@@ -71,6 +71,14 @@ extern "C" {
 #define BSP_USART1_TX_PIN       GPIO_PIN_9
 #define BSP_USART1_RX_PORT      GPIOA
 #define BSP_USART1_RX_PIN       GPIO_PIN_10
+#define BSP_USART1_RX_DMA_STREAM         DMA2_Stream2
+#define BSP_USART1_RX_DMA_CHANNEL        DMA_CHANNEL_4
+#define BSP_USART1_RX_DMA_IRQn           DMA2_Stream2_IRQn
+#define BSP_USART1_RX_DMA_IRQHandler     DMA2_Stream2_IRQHandler
+#define BSP_USART1_TX_DMA_STREAM         DMA2_Stream7
+#define BSP_USART1_TX_DMA_CHANNEL        DMA_CHANNEL_4
+#define BSP_USART1_TX_DMA_IRQn           DMA2_Stream7_IRQn
+#define BSP_USART1_TX_DMA_IRQHandler     DMA2_Stream7_IRQHandler
 #if (BSP_USART1_HW_CTRL == BSP_ON)
 #define BSP_USART1_RTS_PORT     not_defined
 #define BSP_USART1_RTS_PIN      not_defined  
@@ -85,6 +93,14 @@ extern "C" {
 #define BSP_USART3_TX_PIN       GPIO_PIN_8
 #define BSP_USART3_RX_PORT      GPIOD
 #define BSP_USART3_RX_PIN       GPIO_PIN_9
+#define BSP_USART3_RX_DMA_STREAM         DMA1_Stream1
+#define BSP_USART3_RX_DMA_CHANNEL        DMA_CHANNEL_4
+#define BSP_USART3_RX_DMA_IRQn           DMA1_Stream1_IRQn
+#define BSP_USART3_RX_DMA_IRQHandler     DMA1_Stream1_IRQHandler
+#define BSP_USART3_TX_DMA_STREAM         DMA1_Stream4
+#define BSP_USART3_TX_DMA_CHANNEL        DMA_CHANNEL_7
+#define BSP_USART3_TX_DMA_IRQn           DMA1_Stream4_IRQn
+#define BSP_USART3_TX_DMA_IRQHandler     DMA1_Stream4_IRQHandler
 #if (BSP_USART3_HW_CTRL == BSP_ON)
 #define BSP_USART3_RTS_PORT     GPIOD
 #define BSP_USART3_RTS_PIN      GPIO_PIN_12  
@@ -100,6 +116,14 @@ extern "C" {
 #define BSP_USART6_TX_PIN       GPIO_PIN_6
 #define BSP_USART6_RX_PORT      GPIOC
 #define BSP_USART6_RX_PIN       GPIO_PIN_7
+#define BSP_USART6_RX_DMA_STREAM         DMA2_Stream1
+#define BSP_USART6_RX_DMA_CHANNEL        DMA_CHANNEL_5
+#define BSP_USART6_RX_DMA_IRQn           DMA2_Stream1_IRQn
+#define BSP_USART6_RX_DMA_IRQHandler     DMA2_Stream1_IRQHandler
+#define BSP_USART6_TX_DMA_STREAM         DMA2_Stream6
+#define BSP_USART6_TX_DMA_CHANNEL        DMA_CHANNEL_5
+#define BSP_USART6_TX_DMA_IRQn           DMA2_Stream6_IRQn
+#define BSP_USART6_TX_DMA_IRQHandler     DMA2_Stream6_IRQHandler
 #if (BSP_USART6_HW_CTRL == BSP_ON)
 #define BSP_USART6_RTS_PORT     not_defined
 #define BSP_USART6_RTS_PIN      not_defined  
@@ -115,6 +139,11 @@ extern "C" {
 #define BSP_UART7_TX_PIN       GPIO_PIN_8
 #define BSP_UART7_RX_PORT      GPIOE
 #define BSP_UART7_RX_PIN       GPIO_PIN_7
+#define BSP_UART7_RX_DMA_STREAM          DMA1_Stream3
+#define BSP_UART7_RX_DMA_CHANNEL         DMA_CHANNEL_5
+#define BSP_UART7_RX_DMA_IRQn            DMA1_Stream3_IRQn
+#define BSP_UART7_RX_DMA_IRQHandler      DMA1_Stream3_IRQHandler
+/* no UART7 tx stream: DMA1_Stream1 is taken by USART3 rx */
 #if (BSP_UART7_HW_CTRL == BSP_ON)
 #define BSP_UART7_RTS_PORT     not_defined
 #define BSP_UART7_RTS_PIN      not_defined  
@@ -136,6 +165,13 @@ extern "C" {
   
 #define BSP_USART_RX_INT(USARTx)                ((USARTx)->SR & USART_SR_RXNE)
 #define BSP_USART_TX_INT(USARTx)                ((USARTx)->SR & USART_SR_TXE)
+#define BSP_USART_IDLE_INT(USARTx)              ((USARTx)->SR & USART_SR_IDLE)
+#define BSP_USART_ERR_INT(USARTx)               ((USARTx)->SR & (USART_SR_ORE | USART_SR_FE | USART_SR_NE))
+
+#define BSP_UART_START_RX_DMA(USARTx)           SET_BIT((USARTx)->CR3, USART_CR3_DMAR)
+#define BSP_UART_STOP_RX_DMA(USARTx)            CLEAR_BIT((USARTx)->CR3, USART_CR3_DMAR)
+#define BSP_UART_START_TX_DMA(USARTx)           SET_BIT((USARTx)->CR3, USART_CR3_DMAT)
+#define BSP_UART_STOP_TX_DMA(USARTx)            CLEAR_BIT((USARTx)->CR3, USART_CR3_DMAT)
 
 /** @brief  Enable the specified Usart interrupts.
   * @param  __HANDLE__: specifies the USART Handle.
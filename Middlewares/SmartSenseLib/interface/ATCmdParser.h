@@ -4,6 +4,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
 /** \addtogroup platform */
 /** @{*/
 /**
@@ -30,6 +32,18 @@
 * @endcode
 */
 
+/**
+* Byte stream the parser runs on, the modem uart unless replaced
+*/
+typedef struct atparser_transport {
+  // Bytes readable in place at *data, waiting up to timeout ms for the first
+  uint32_t (*peek)(void *ctx, const uint8_t **data, uint32_t timeout);
+  // Release size bytes from the front of the last peeked span
+  void (*consume)(void *ctx, uint32_t size);
+  // Send count buffers back to back, returns the number of bytes queued
+  uint32_t (*writev)(void *ctx, const struct iovec *iov, uint32_t count);
+} atparser_transport;
+
 typedef struct oob {
   unsigned len;
   const char *prefix;
@@ -38,11 +52,145 @@ typedef struct oob {
   struct oob *next;
 } oob;
 
+// Prefix trie of the registered oob handlers, one node per character
+typedef struct oob_node {
+  char c;
+  struct oob_node *child;
+  struct oob_node *sibling;
+  oob *handler;
+} oob_node;
+
+#ifndef ATPARSER_PATTERN_MAX_OPS
+#define ATPARSER_PATTERN_MAX_OPS    12
+#endif
+
+#ifndef ATPARSER_PATTERN_MAX_FIELDS
+#define ATPARSER_PATTERN_MAX_FIELDS 4
+#endif
+
+typedef enum {
+  ATPARSER_OP_LITERAL,  // text that must appear verbatim
+  ATPARSER_OP_SPACE,    // any amount of whitespace, like a blank in scanf
+  ATPARSER_OP_INT,      // %d
+  ATPARSER_OP_UINT,     // %u
+  ATPARSER_OP_STRING,   // %[^c], up to the stop character
+} atparser_op_type;
+
+typedef struct atparser_op {
+  uint8_t type;
+  bool store;         // false for %* conversions
+  char stop;          // STRING: character that ends the field
+  uint16_t len;       // LITERAL: text length, STRING: field width (0 = unlimited)
+  const char *text;   // LITERAL: points into the format string
+} atparser_op;
+
+/**
+* Response format compiled by atparser_pattern_compile
+*/
+typedef struct atparser_pattern {
+  const char *format;
+  atparser_op ops[ATPARSER_PATTERN_MAX_OPS];
+  uint8_t op_count;
+  uint8_t field_count;
+  bool whole_line;
+} atparser_pattern;
+
+#ifndef ATPARSER_CMD_SIZE
+#define ATPARSER_CMD_SIZE           80    // longest command accepted by atparser_submit
+#endif
+
+#ifndef ATPARSER_RESPONSE_SIZE
+#define ATPARSER_RESPONSE_SIZE      64    // response line handed to the completion callback
+#endif
+
+#ifndef ATPARSER_ENGINE_QUEUE_LENGTH
+#define ATPARSER_ENGINE_QUEUE_LENGTH 8
+#endif
+
+#ifndef ATPARSER_SCRIPT_LINE_SIZE
+#define ATPARSER_SCRIPT_LINE_SIZE   128   // longest line of concatenated script steps
+#endif
+
+#ifndef ATPARSER_LATENCY_COMMANDS
+#define ATPARSER_LATENCY_COMMANDS   16    // commands whose latency is learned
+#endif
+
+#ifndef ATPARSER_TIMEOUT_FACTOR
+#define ATPARSER_TIMEOUT_FACTOR     2     // learned timeout is the p99 latency times this
+#endif
+
+#ifndef ATPARSER_TIMEOUT_MIN
+#define ATPARSER_TIMEOUT_MIN        200   // ms, lower clamp of a learned timeout
+#endif
+
+#define ATPARSER_LATENCY_KEY_SIZE   12    // command name kept, e.g. "AT+UDNSRN"
+#define ATPARSER_LATENCY_BUCKETS    18    // bucket k counts latencies below 2^k ms
+#define ATPARSER_LATENCY_SAMPLES    8     // samples needed before a timeout is learned
+#define ATPARSER_LATENCY_WINDOW     128   // counts are halved when reaching this
+
+// AT trace levels, what ATPARSER_TRACE_LEVEL compiles in
+#define ATPARSER_TRACE_NONE     0     // no trace code at all
+#define ATPARSER_TRACE_IO       1     // commands sent and responses matched
+#define ATPARSER_TRACE_ALL      2     // also oob, abort, failure and skipped lines
+
+#ifndef ATPARSER_TRACE_LEVEL
+#define ATPARSER_TRACE_LEVEL        ATPARSER_TRACE_ALL
+#endif
+
+#ifndef ATPARSER_TRACE_DATA_SIZE
+#define ATPARSER_TRACE_DATA_SIZE    48    // bytes per queued trace entry, longer data is split
+#endif
+
+#ifndef ATPARSER_TRACE_QUEUE_LENGTH
+#define ATPARSER_TRACE_QUEUE_LENGTH 16
+#endif
+
+// atparser_step flags
+#define ATPARSER_STEP_CONCAT    0x01  // may share one command line with the next step
+#define ATPARSER_STEP_OPTIONAL  0x02  // a failure does not stop the script
+
+/**
+* One command of an AT script
+*
+* The step succeeds when the response line (if any) and then OK arrive.
+*/
+typedef struct atparser_step {
+  const char *cmd;          // command line, sent as is
+  const char *response;     // atparser_recv format of an information line, or NULL
+  void *capture;            // where the single conversion of response is stored, or NULL
+  uint16_t timeout;         // ms limit for the whole response, 0 is the parser timeout
+  uint8_t retries;          // attempts after the first one fails
+  uint16_t retry_delay;     // ms between attempts
+  uint8_t flags;            // ATPARSER_STEP_xxx
+} atparser_step;
+
+/**
+* Completion of a command queued with atparser_submit
+*
+* @param ctx context given to atparser_submit
+* @param success true if the response (if any) and the final OK were received
+* @param response the line that matched the response pattern, empty if none
+*/
+typedef void (*atparser_callback)(void *ctx, bool success, const char *response);
+
+/**
+* Latency histogram of one command, in power of two buckets
+*/
+typedef struct atparser_latency {
+  char cmd[ATPARSER_LATENCY_KEY_SIZE];
+  uint16_t count;
+  uint16_t buckets[ATPARSER_LATENCY_BUCKETS];
+  uint32_t used;              // tick of the last use, the oldest entry is recycled
+  bool fixed;                 // limit always applies, the entry is never recycled
+} atparser_latency;
+
 typedef struct ATCmdParser
 {
   // File handle
   // Not owned by ATCmdParser
   int _fd;
+  const atparser_transport *_transport;
+  void *_transport_ctx;
   
   int _buffer_size;
   char *_buffer;
@@ -55,10 +203,43 @@ typedef struct ATCmdParser
   bool _dbg_on;
   bool _aborted;
   oob *_oobs;
+  oob_node *_oob_root;
+  const oob_node *_oob_node;  // trie position of the current line, NULL once it left
+  
+  // Received span borrowed from the uart rx fifo
+  const uint8_t *_rx_data;
+  int _rx_len;
+  int _rx_pos;
+  
+  // Command waiting for its final result
+  atparser_latency _latency[ATPARSER_LATENCY_COMMANDS];
+  atparser_latency *_cmd;     // NULL once OK, an error or a timeout ended it
+  uint32_t _cmd_start;        // ms at which it was sent
+  uint32_t _cmd_seen;         // ms after sending of the last matched response
+  uint32_t _cmd_timeout;      // ms allowed from sending, 0 when _timeout applies per character
+  
+  // Asynchronous command engine
+  void *_engine_queue;
+  void *_engine_task;
+  void (*_engine_lock)(void);
+  void (*_engine_unlock)(void);
 } ATCmdParser;
 
 
 ATCmdParser *atparser_create(int fd);
+
+/**
+* Create a parser on another byte stream, e.g. a transcript replay
+*/
+ATCmdParser *atparser_create_transport(const atparser_transport *transport, void *ctx);
+
+/**
+* Replace the byte stream, e.g. to put a recorder in front of it
+*
+* Must not be called while a command is in progress.
+*/
+void atparser_set_transport(ATCmdParser *self, const atparser_transport *transport, void *ctx);
+const atparser_transport *atparser_get_transport(ATCmdParser *self, void **ctx);
 void atparser_destroy(ATCmdParser *self);
 
 
@@ -82,10 +263,25 @@ void atparser_set_delimiter(ATCmdParser *self, const char *output_delimiter);
 /**
 * Allows traces from modem to be turned on or off
 *
+* Only traces compiled in by ATPARSER_TRACE_LEVEL can be turned on.
+*
 * @param on set as 1 to turn on traces and vice versa.
 */
 void atparser_debug_on(ATCmdParser *self, uint8_t on);
 
+/**
+* Start the task that prints AT traces
+*
+* Once it runs, traces are copied to a queue and formatted by this task
+* instead of by the task talking to the modem; entries that find the queue
+* full are dropped and counted. Before, traces are printed in place.
+*
+* @param stack_size trace task stack depth in words
+* @param priority trace task priority, below the modem users
+* @return true if the task runs, or tracing is compiled out
+*/
+bool atparser_trace_start(uint16_t stack_size, uint32_t priority);
+
 
 /**
 * Sends an AT command
@@ -102,6 +298,45 @@ bool atparser_send(ATCmdParser *self, const char *command, ...);
 
 bool atparser_vsend(ATCmdParser *self, const char *command, va_list args);
 
+/**
+* Sends an AT command with its own timeout
+*
+* The responses to the command are awaited until a deadline set when it is
+* sent, instead of _timeout per character. The deadline is the learned
+* timeout of the command (its p99 latency times ATPARSER_TIMEOUT_FACTOR)
+* clamped to limit, or limit until enough latencies were seen. A final
+* ERROR ends the wait at once for commands sent either way.
+*
+* @param limit longest the command may take in ms
+* @param command printf-like format string of command to send
+* @return true only if command is successfully sent
+*/
+bool atparser_command(ATCmdParser *self, int limit, const char *command, ...);
+
+bool atparser_vcommand(ATCmdParser *self, int limit, const char *command, va_list args);
+
+/**
+* Timeout atparser_command would use for a command
+*
+* @param command command line or its name, e.g. "AT+COPS?"
+* @param limit longest the command may take in ms
+* @return ms, at least ATPARSER_TIMEOUT_MIN unless limit is smaller
+*/
+int atparser_command_timeout(ATCmdParser *self, const char *command, int limit);
+
+/**
+* Never learn the timeout of a command
+*
+* For commands whose latency depends on the network rather than the modem,
+* e.g. a DNS lookup or a socket read, a fast p99 would cut off the slow
+* answer and leave it to be taken for the response of the next command.
+* atparser_command then always waits up to its limit for this command.
+*
+* @param command command line or its name, e.g. "AT+UDNSRN"
+* @return true, false if all latency entries are fixed already
+*/
+bool atparser_command_fixed(ATCmdParser *self, const char *command);
+
 /**
 * Receive an AT response
 *
@@ -120,6 +355,103 @@ bool atparser_recv(ATCmdParser *self, const char *response, ...);
 
 bool atparser_vrecv(ATCmdParser *self, const char *response, va_list args);
 
+/**
+* Compile a response format into a reusable matcher
+*
+* Supports the subset of scanf used for AT responses: literal text,
+* whitespace, %d, %u, %N[^c] and their %* forms. The format must fit one
+* line and end in literal text or a newline, so a match is known to be
+* complete as soon as its last character arrives.
+*
+* @param pattern matcher to fill in
+* @param format response format, must outlive the pattern
+* @return true if the format could be compiled
+*/
+bool atparser_pattern_compile(atparser_pattern *pattern, const char *format);
+
+/**
+* Receive an AT response using a compiled pattern
+*
+* Same as atparser_recv for a single line response, but received characters
+* are fed to the pattern as they arrive so no format rewriting or scanf is
+* needed. Fields are stored in order, as int*, unsigned* or char* (with room
+* for the field width plus a terminator).
+*
+* @param pattern matcher made by atparser_pattern_compile
+* @param ... pointers to store the extracted fields in
+* @return true only if response is successfully matched
+*/
+bool atparser_recv_pattern(ATCmdParser *self, const atparser_pattern *pattern, ...);
+
+bool atparser_vrecv_pattern(ATCmdParser *self, const atparser_pattern *pattern, va_list args);
+
+/**
+* Extract the fields of a compiled pattern from a line already received,
+* e.g. the response handed to an atparser_callback
+*
+* @param pattern matcher made by atparser_pattern_compile
+* @param line text to match
+* @param ... pointers to store the extracted fields in
+* @return true if the line matches the pattern
+*/
+bool atparser_pattern_parse(const atparser_pattern *pattern, const char *line, ...);
+
+/**
+* Run an AT script
+*
+* Steps run back to back. Consecutive steps flagged ATPARSER_STEP_CONCAT
+* that expect no information line are sent as one command line joined with
+* ';' and share one OK; if that fails they are retried one by one.
+*
+* @param steps commands to run in order
+* @param count number of steps
+* @return count if every required step succeeded, else the index of the
+*         first step that failed
+*/
+int atparser_run_script(ATCmdParser *self, const atparser_step *steps, int count);
+
+/**
+* Start the task that runs commands queued with atparser_submit
+*
+* The channel lock shared with synchronous users of the parser is taken
+* around every command.
+*
+* @param lock takes the channel, may be NULL
+* @param unlock releases the channel, may be NULL
+* @param stack_size engine task stack depth in words
+* @param priority engine task priority
+* @return true if the engine is running
+*/
+bool atparser_engine_start(ATCmdParser *self, void (*lock)(void), void (*unlock)(void),
+                           uint16_t stack_size, uint32_t priority);
+
+/**
+* Stop the engine task started by atparser_engine_start
+*
+* Waits for the command in progress to finish, then deletes the task and
+* its queue. Commands still queued are completed with success false from
+* the caller's context. Must not be called with the channel lock held, and
+* nothing may be submitted meanwhile.
+*/
+void atparser_engine_stop(ATCmdParser *self);
+
+/**
+* Queue a command without waiting for it
+*
+* The engine task sends the command, waits up to timeout for the line
+* matching response (if not NULL) and then for the final OK, and reports
+* the outcome through callback from its own context.
+*
+* @param cmd command to send, copied (1 to ATPARSER_CMD_SIZE - 1 characters)
+* @param response pattern of the information line to capture, or NULL
+* @param timeout longest the command may take in ms, see atparser_command
+* @param callback completion callback, may be NULL
+* @param ctx passed to callback
+* @return true if the command was queued
+*/
+bool atparser_submit(ATCmdParser *self, const char *cmd, const atparser_pattern *response,
+                     int timeout, atparser_callback callback, void *ctx);
+
 /**
 * Write a single byte to the underlying stream
 *
@@ -153,6 +485,18 @@ int atparser_write(ATCmdParser *self, const char *data, int size);
 */
 int atparser_read(ATCmdParser *self, char *data, int size);
 
+/**
+* Read exactly size raw bytes, e.g. a socket payload announced by a response
+*
+* Bytes go straight from the uart fifo into data; no newline folding and no
+* oob scanning is applied to them. Line mode resumes afresh afterwards.
+*
+* @param data the destination for the read bytes
+* @param size number of bytes to read
+* @return number of bytes read, less than size only on timeout
+*/
+int atparser_read_counted(ATCmdParser *self, char *data, int size);
+
 /**
 * Direct printf to underlying stream
 * @see printf
@@ -0,0 +1,102 @@
+/**
+* @file
+* @brief    AT traffic recorder and transcript replay
+* @warning
+* @details
+*
+* The recorder sits between an ATCmdParser and its transport and reports
+* every chunk sent and received with a timestamp. The replay transport
+* feeds such a transcript back into a parser without a modem, so the
+* parser and the code on top of it can be run and timed on a host.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+#ifndef _AT_TRANSPORT_H
+#define _AT_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ATCmdParser.h"
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+#define ATPARSER_RECORD_TX  'T'
+#define ATPARSER_RECORD_RX  'R'
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+typedef struct atparser_record
+{
+  uint32_t time;          // ms since the recording started
+  uint8_t dir;            // ATPARSER_RECORD_TX or ATPARSER_RECORD_RX
+  uint16_t len;
+  const uint8_t *data;
+} atparser_record;
+
+typedef void (*atparser_record_sink)(void *ctx, const atparser_record *record);
+
+typedef struct atparser_recorder
+{
+  const atparser_transport *inner;
+  void *inner_ctx;
+  atparser_record_sink sink;
+  void *sink_ctx;
+  uint32_t start;
+  const uint8_t *span;    // last span handed to the parser
+} atparser_recorder;
+
+typedef struct atparser_replay
+{
+  atparser_record *records;
+  uint32_t count;
+  uint32_t rx_next;       // next record to deliver to the parser
+  uint32_t rx_offset;     // bytes of it already consumed
+  uint32_t tx_next;       // next record the parser is expected to write
+  uint32_t tx_offset;     // bytes of it already written
+  uint32_t clock;         // virtual ms, advanced by record times and timeouts
+  uint32_t timeouts;      // peeks that found nothing to deliver
+  uint32_t mismatches;    // written bytes that differ from the transcript
+  bool owned;             // records allocated by atparser_replay_load
+} atparser_replay;
+
+/*------------------------- PUBLIC VARIABLES ---------------------------------*/
+
+extern const atparser_transport atparser_recorder_transport;
+extern const atparser_transport atparser_replay_transport;
+
+/*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
+
+/* Put a recorder in front of the parser's transport; every chunk is passed
+ * to sink from the context that sends or receives it. */
+void atparser_recorder_start(atparser_recorder *recorder, ATCmdParser *parser,
+                             atparser_record_sink sink, void *sink_ctx);
+void atparser_recorder_stop(atparser_recorder *recorder, ATCmdParser *parser);
+
+/* Sink that writes "ATREC <time> <T|R> <len> "<escaped data>"" lines to the
+ * log, the format atparser_replay_load reads back. */
+void atparser_recorder_log_sink(void *ctx, const atparser_record *record);
+
+/* Replay records in order: received chunks are delivered once every chunk
+ * written before them in the transcript has been written by the parser. */
+void atparser_replay_init(atparser_replay *replay, atparser_record *records, uint32_t count);
+
+/* Build the records from a captured log; lines without "ATREC " are skipped.
+ * Returns the number of records loaded. */
+uint32_t atparser_replay_load(atparser_replay *replay, const char *text);
+void atparser_replay_free(atparser_replay *replay);
+
+/* True once every record has been replayed */
+bool atparser_replay_done(const atparser_replay *replay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _AT_TRANSPORT_H */
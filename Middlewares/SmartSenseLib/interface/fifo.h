@@ -17,6 +17,8 @@ extern "C" {
 
 /*------------------------- MACRO DEFINITIONS --------------------------------*/
 
+#define FIFO_NO_DELIMITER   (-1)
+
 /*------------------------- TYPE DEFINITIONS ---------------------------------*/
 
 typedef const void * FifoHandle_t;
@@ -25,6 +27,15 @@ typedef const void * FifoHandle_t;
 
 /*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
 
+/* Fifos are lock-free single producer / single consumer rings: at most one
+ * context may write and at most one (possibly different) context may read.
+ * Either side may be an ISR as long as it passes a zero timeout.
+ *
+ * With buf NULL the ring is allocated and holds size bytes. A caller
+ * supplied buf keeps one byte free to tell a full ring from an empty one,
+ * so it holds size - 1 bytes: pass a buffer one byte larger than the
+ * capacity needed.
+ */
 FifoHandle_t fifo_create(uint8_t *buf, uint32_t size);
 void fifo_destroy(FifoHandle_t hfifo);
 
@@ -33,6 +44,33 @@ uint32_t fifo_write(FifoHandle_t hfifo, const uint8_t *buf, uint32_t nbytes, uin
 uint32_t fifo_read(FifoHandle_t hfifo, uint8_t *buf, uint32_t nbytes, uint32_t timeout);
 
 uint32_t fifo_length(FifoHandle_t hfifo);
+uint32_t fifo_free(FifoHandle_t hfifo);
+
+/* Zero-copy access. peek returns the number of buffered bytes that can be
+ * read in place at *data (blocking up to timeout for the first one) and
+ * consume releases them. reserve/commit do the same for the producer side.
+ * A span is only valid until it is consumed/committed.
+ */
+uint32_t fifo_peek_contiguous(FifoHandle_t hfifo, const uint8_t **data, uint32_t timeout);
+/* Same as peek without ever blocking or arming the reader, usable with
+ * interrupts masked.
+ */
+uint32_t fifo_contiguous(FifoHandle_t hfifo, const uint8_t **data);
+void fifo_consume(FifoHandle_t hfifo, uint32_t nbytes);
+
+uint32_t fifo_reserve(FifoHandle_t hfifo, uint8_t **data, uint32_t timeout);
+void fifo_commit(FifoHandle_t hfifo, uint32_t nbytes);
+
+/* Block the reader until at least watermark bytes are buffered, the
+ * delimiter byte (or FIFO_NO_DELIMITER) is buffered, or timeout expires.
+ * Returns the number of buffered bytes; nothing is consumed.
+ */
+uint32_t fifo_wait(FifoHandle_t hfifo, uint32_t watermark, int32_t delimiter, uint32_t timeout);
+
+/* Make a reader blocked in fifo_wait return early, called by another task.
+ * If no reader is waiting the next fifo_wait returns at once.
+ */
+void fifo_wait_cancel(FifoHandle_t hfifo);
 
 
 /*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
@@ -41,6 +41,7 @@ struct ssCoord_time
 
 /*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
 uint8_t ssGNSSinit(USART_TypeDef* USARTx, uint32_t flags);
+void ssGNSSdeinit(void);
 void ssGNSSRead(void);
 bool ssGNSSGetCoords(struct ssGNSScoords *coords);
 bool ssGNSSGetTime(char *datetime, size_t size);
@@ -25,6 +25,8 @@ extern "C" {
   
 #define SOCKET_INVALID (-1)
   
+#define MODEM_DNS_NAME_SIZE 64    // host names resolved are shorter than this
+  
 #define SOCKET_CLOSED   0
 #define SOCKET_OPENED   1
   
@@ -123,8 +125,10 @@ typedef struct {
 typedef struct SockCtrl
 {
   uint32_t state;
-  volatile uint32_t pending;
-  uint8_t *buffer;
+  volatile uint32_t pending;      // bytes announced by the modem, not yet in rx
+  int protocol;
+  FifoHandle_t rx;                // receive ring, filled by the modem reader task
+  volatile uint8_t readers;       // tasks reading rx, which stays allocated until they leave
 } SockCtrl;
 
 typedef struct SocketAddress
@@ -141,6 +145,10 @@ typedef struct SocketAddress_in
 } SocketAddress_in;
   
   
+/** Completion of modem_gethostbyname_async, status 0 on success. Runs before
+* modem_gethostbyname_async returns when the cache answers. */
+typedef void (*modem_dns_callback)(void *ctx, int32_t status, uint32_t address);
+
 typedef struct modem_t
 {
   netif_t com_dev;
@@ -153,6 +161,7 @@ typedef struct modem_t
   ATCmdParser *at;
   int at_timeout;
   int fd;
+  uint32_t baudrate;
   DeviceInfo dev_info;
   bool modem_initialised;
   SockCtrl sockets[SOCKET_COUNT];
@@ -167,6 +176,7 @@ typedef struct modem_t
   bool modem_init(modem_t *self, const char *pin);
   
   bool modem_nwk_register(modem_t *self);
+  bool modem_nwk_wait_registered(modem_t *self, uint32_t timeout);
   bool modem_nwk_deregister(modem_t *self);
   
   bool modem_nwk_connect(modem_t *self);
@@ -177,9 +187,14 @@ typedef struct modem_t
                               const char *uname,
                               const char *pwd);
   
+  // Both fail for a host name of MODEM_DNS_NAME_SIZE characters or more
   int32_t modem_gethostbyname(modem_t *self,
                               const char *host,
                               uint32_t *address);
+  bool modem_gethostbyname_async(modem_t *self,
+                                 const char *host,
+                                 modem_dns_callback callback,
+                                 void *ctx);
   
   int modem_socket_open(modem_t *self, int protocol);
   bool modem_socket_close(modem_t *self, int socket);
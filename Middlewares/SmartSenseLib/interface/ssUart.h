@@ -12,6 +12,7 @@
 #define _SS_UART_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "FreeRTOS.h"
 #include "queue.h"
@@ -26,6 +27,15 @@ extern "C" {
 
 #define DDAL_UART_OK    0
 #define DDAL_UART_ERR   1
+
+/* ssUartConfigType.DmaMode flags */
+#define SS_UART_DMA_NONE    0x00U
+#define SS_UART_DMA_RX      0x01U   /* circular rx dma, drained on idle line and half/full transfer */
+#define SS_UART_DMA_TX      0x02U   /* tx fifo sent in contiguous dma bursts */
+
+#if !defined(SS_UART_DMA_RX_BUFFER_SIZE)
+#define SS_UART_DMA_RX_BUFFER_SIZE  128
+#endif
   
 /*------------------------- TYPE DEFINITIONS ---------------------------------*/
 
@@ -37,8 +47,24 @@ typedef struct
   uint32_t Parity;
   uint32_t StopBits;
   uint32_t WordLength;
+  uint32_t DmaMode;
 } ssUartConfigType;
 
+typedef struct
+{
+  uint32_t buffer_size;       /* rx/tx fifo size given to ssUartOpen */
+  uint32_t rx_bytes;
+  uint32_t tx_bytes;
+  uint32_t rx_dropped;        /* received while the rx fifo was full */
+  uint32_t overrun_errors;
+  uint32_t framing_errors;
+  uint32_t noise_errors;
+  uint32_t rx_peak;           /* highest rx fifo occupancy */
+  uint32_t tx_peak;           /* highest tx fifo occupancy */
+  uint32_t irq_count;         /* uart and dma stream interrupts */
+  uint32_t irq_per_sec;       /* rate since the previous ssUartGetStats call */
+} ssUartStatsType;
+
 /*------------------------- PUBLIC VARIABLES ---------------------------------*/
 
 /*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
@@ -56,8 +82,32 @@ uint32_t ssUartGets(uint32_t id, uint8_t *s, uint32_t size, uint32_t timeout);
 uint8_t ssUartPutc(uint32_t id, const char c);
 uint8_t ssUartPuts(uint32_t id, const char *s);
 uint32_t ssUartWrite(uint32_t id, const uint8_t *s, const uint32_t size);
+/* Queue count buffers back to back; no other task's write can land in between. */
+uint32_t ssUartWritev(uint32_t id, const struct iovec *iov, uint32_t count);
 uint32_t ssUartRead(uint32_t id, uint8_t *s, const uint32_t size, uint32_t timeout);
 
+/* In-place receive: peek returns the number of bytes readable at *data
+ * (waiting up to timeout for the first one), consume releases them. */
+uint32_t ssUartPeek(uint32_t id, const uint8_t **data, uint32_t timeout);
+void ssUartConsume(uint32_t id, uint32_t size);
+
+/* Sleep until watermark bytes or the delimiter byte are received, or timeout
+ * expires; returns the number of buffered bytes. */
+uint32_t ssUartWait(uint32_t id, uint32_t watermark, int32_t delimiter, uint32_t timeout);
+/* Wake a task blocked in ssUartWait from another task. */
+void ssUartWaitCancel(uint32_t id);
+
+/* Change the line speed of an open uart; pending tx data is sent first and
+ * buffered rx data is kept. */
+uint32_t ssUartSetBaudrate(uint32_t id, uint32_t baudrate);
+
+uint32_t ssUartGetStats(uint32_t id, ssUartStatsType *stats);
+
+/* Release an open uart: pending tx data gets a chance to leave, then the port is
+ * stopped and its fifos and dma buffers go back to the heap. No task may still
+ * be blocked on the uart. The slot can be opened again afterwards. */
+uint32_t ssUartClose(uint32_t id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,34 @@
+/**
+ * @file     
+ * @brief    
+ * @warning
+ * @details
+ *
+ * Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+ *
+ **/
+
+#ifndef _SS_UART_CLI_H
+#define _SS_UART_CLI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+  
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+/*------------------------- PUBLIC VARIABLES ---------------------------------*/
+
+/*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
+
+void ssUartCliInit(void);
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SS_UART_CLI_H */
@@ -7,6 +7,8 @@
 #include <assert.h>
 
 #include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
 
 #include "ssLogging.h"
 #include "ssUart.h"
@@ -28,7 +30,99 @@
 #define CR  13
 #endif
 
+static void atparser_rx_release(ATCmdParser *self);
+static int atparser_copy_raw(ATCmdParser *self, char *data, int size);
+static uint32_t atparser_uart_peek(void *ctx, const uint8_t **data, uint32_t timeout);
+static void atparser_uart_consume(void *ctx, uint32_t size);
+static uint32_t atparser_uart_writev(void *ctx, const struct iovec *iov, uint32_t count);
+static int atparser_getc_line(ATCmdParser *self);
+static int atparser_literal_prefix(const char *format, int len);
+static bool atparser_literal_end(const char *format, int len);
+static int atparser_check_oob(ATCmdParser *self, char c, int len);
+static uint32_t atparser_now(void);
+static uint32_t atparser_rx_timeout(ATCmdParser *self);
+static atparser_latency *atparser_latency_find(ATCmdParser *self, const char *command, bool create);
+static void atparser_command_end(ATCmdParser *self, uint32_t latency);
+static void atparser_command_response(ATCmdParser *self, const char *line, int len);
+static bool atparser_command_failed(ATCmdParser *self, const char *line);
+static void atparser_oob_free(oob_node *node);
+
+#if ATPARSER_TRACE_LEVEL > ATPARSER_TRACE_NONE
+static void atparser_trace(ATCmdParser *self, const char *tag, const char *data, int len);
+#endif
+
+// Trace points vanish entirely, arguments included, below their level
+#if ATPARSER_TRACE_LEVEL >= ATPARSER_TRACE_IO
+#define AT_TRACE_IO(self, tag, data, len)     atparser_trace(self, tag, data, len)
+#else
+#define AT_TRACE_IO(self, tag, data, len)     ((void)0)
+#endif
+
+#if ATPARSER_TRACE_LEVEL >= ATPARSER_TRACE_ALL
+#define AT_TRACE_EVENT(self, tag, data, len)  atparser_trace(self, tag, data, len)
+#else
+#define AT_TRACE_EVENT(self, tag, data, len)  ((void)0)
+#endif
+
+// Result of an oob check
+#define OOB_NONE      0
+#define OOB_HANDLED   1
+#define OOB_ABORTED   (-1)
+
+// Progress of a compiled pattern over the current line
+typedef struct atparser_match {
+  uint8_t op;
+  uint16_t pos;
+  int32_t value;
+  bool negative;
+  uint8_t field;
+  struct {
+    int32_t value;
+    uint16_t start;
+    uint16_t len;
+  } fields[ATPARSER_PATTERN_MAX_FIELDS];
+} atparser_match;
+
+#define MATCH_MORE    0
+#define MATCH_DONE    1
+#define MATCH_FAIL    (-1)
+
+#define ATPARSER_ENGINE_TASK_NAME   "AtEngine"
+
+// Command queued for the engine task
+typedef struct atparser_request {
+  char cmd[ATPARSER_CMD_SIZE];
+  const atparser_pattern *response;
+  int timeout;
+  atparser_callback callback;
+  void *ctx;
+} atparser_request;
+
+static int atparser_recv_match(ATCmdParser *self, const atparser_pattern *pattern, atparser_match *match);
+static void atparser_engine_task(void *param);
+static int atparser_script_group(const atparser_step *steps, int count, char *line, int size);
+static bool atparser_script_step(ATCmdParser *self, const atparser_step *step, int limit);
+
+static const atparser_transport atparser_uart_transport =
+{
+  atparser_uart_peek,
+  atparser_uart_consume,
+  atparser_uart_writev,
+};
+
 ATCmdParser *atparser_create(int fd)
+{
+  ATCmdParser *parser = atparser_create_transport(&atparser_uart_transport, (void *)(intptr_t)fd);
+  
+  if(parser)
+  {
+    parser->_fd = fd;
+  }
+  
+  return parser;
+}
+
+ATCmdParser *atparser_create_transport(const atparser_transport *transport, void *ctx)
 {
   ATCmdParser *parser = NULL;
   
@@ -43,15 +137,67 @@ ATCmdParser *atparser_create(int fd)
     atparser_set_delimiter(parser, "\r");
     atparser_debug_on(parser, true);
     parser->_oobs = NULL;
-    parser->_fd = fd;
+    parser->_oob_root = NULL;
+    parser->_oob_node = NULL;
+    parser->_fd = -1;
+    parser->_transport = transport;
+    parser->_transport_ctx = ctx;
+    parser->_rx_data = NULL;
+    parser->_rx_len = 0;
+    parser->_rx_pos = 0;
+    memset(parser->_latency, 0, sizeof(parser->_latency));
+    parser->_cmd = NULL;
+    parser->_cmd_timeout = 0;
+    parser->_engine_queue = NULL;
+    parser->_engine_task = NULL;
+    parser->_engine_lock = NULL;
+    parser->_engine_unlock = NULL;
   }
   
   return parser;
 }
 
 
+void atparser_set_transport(ATCmdParser *self, const atparser_transport *transport, void *ctx)
+{
+  atparser_rx_release(self);
+  self->_transport = transport;
+  self->_transport_ctx = ctx;
+}
+
+const atparser_transport *atparser_get_transport(ATCmdParser *self, void **ctx)
+{
+  if (ctx) {
+    *ctx = self->_transport_ctx;
+  }
+  return self->_transport;
+}
+
+/*------------------------- UART TRANSPORT -----------------------------------*/
+
+static uint32_t atparser_uart_peek(void *ctx, const uint8_t **data, uint32_t timeout)
+{
+  return ssUartPeek((uint32_t)(intptr_t)ctx, data, timeout);
+}
+
+static void atparser_uart_consume(void *ctx, uint32_t size)
+{
+  ssUartConsume((uint32_t)(intptr_t)ctx, size);
+}
+
+static uint32_t atparser_uart_writev(void *ctx, const struct iovec *iov, uint32_t count)
+{
+  return ssUartWritev((uint32_t)(intptr_t)ctx, iov, count);
+}
+
 void atparser_destroy(ATCmdParser *self)
 {
+  while (self->_oobs) {
+    oob *next = self->_oobs->next;
+    free(self->_oobs);
+    self->_oobs = next;
+  }
+  atparser_oob_free(self->_oob_root);
   vPortFree(self->_buffer);
   vPortFree(self);
 }
@@ -91,20 +237,168 @@ void atparser_debug_on(ATCmdParser *self, uint8_t on)
 // getc/putc handling with timeouts
 int atparser_putc(ATCmdParser *self, char c)
 {
-  return ssUartWrite(self->_fd, (uint8_t *)&c, 1);
+  struct iovec iov = { &c, 1 };
+  
+  return self->_transport->writev(self->_transport_ctx, &iov, 1);
 }
 
 int atparser_getc(ATCmdParser *self)
 {
-  uint8_t c;
-  if(ssUartRead(self->_fd, &c, 1, self->_timeout) == 1)
+  // Bytes are taken straight out of the uart fifo span and only
+  // released back to the fifo when the span is used up
+  if(self->_rx_pos == self->_rx_len)
   {
-    return (int)c;
+    atparser_rx_release(self);
+    self->_rx_len = self->_transport->peek(self->_transport_ctx, &self->_rx_data, atparser_rx_timeout(self));
+    if(self->_rx_len == 0)
+    {
+      // The command in progress took this long at least
+      if(self->_cmd)
+      {
+        atparser_command_end(self, atparser_now() - self->_cmd_start);
+      }
+      return -1;
+    }
   }
-  else
+  
+  return (int)self->_rx_data[self->_rx_pos++];
+}
+
+// Give the part of the borrowed span that was parsed back to the fifo
+static void atparser_rx_release(ATCmdParser *self)
+{
+  if(self->_rx_pos > 0)
   {
-    return -1;
+    self->_transport->consume(self->_transport_ctx, self->_rx_pos);
   }
+  self->_rx_len = 0;
+  self->_rx_pos = 0;
+}
+
+// Copy size bytes span by span, the timeout applies between spans
+static int atparser_copy_raw(ATCmdParser *self, char *data, int size)
+{
+  const uint8_t *span;
+  int count = 0;
+  
+  while (count < size) {
+    int n = self->_transport->peek(self->_transport_ctx, &span, atparser_rx_timeout(self));
+    if (n == 0) {
+      break;
+    }
+    if (n > size - count) {
+      n = size - count;
+    }
+    memcpy(&data[count], span, n);
+    self->_transport->consume(self->_transport_ctx, n);
+    count += n;
+  }
+  
+  return count;
+}
+
+// Next received character with CR, LF, CRLF and LFCR all folded into one '\n'
+static int atparser_getc_line(ATCmdParser *self)
+{
+  while (true) {
+    int c = atparser_getc(self);
+    if (c < 0) {
+      return c;
+    }
+    // Simplify newlines (borrowed from retarget.cpp)
+    if ((c == CR && self->_in_prev != LF) ||
+        (c == LF && self->_in_prev != CR)) {
+      self->_in_prev = c;
+      return '\n';
+    } else if ((c == CR && self->_in_prev == LF) ||
+               (c == LF && self->_in_prev == CR)) {
+      self->_in_prev = c;
+      // onto next character
+      continue;
+    }
+    self->_in_prev = c;
+    return c;
+  }
+}
+
+// Number of characters a format starts with that must appear verbatim in the
+// input. Stops at the first conversion and at whitespace, which scanf matches
+// loosely.
+static int atparser_literal_prefix(const char *format, int len)
+{
+  int i = 0;
+  
+  while (i < len && format[i] != '%' &&
+         format[i] != ' ' && format[i] != '\t' && format[i] != '\n' && format[i] != '\r') {
+    i++;
+  }
+  return i;
+}
+
+// True if a format ends in text that must appear verbatim, so a match can
+// only be complete when that character arrives. False if it ends in a
+// conversion or whitespace, where scanf cannot tell the end of the match.
+static bool atparser_literal_end(const char *format, int len)
+{
+  bool literal = false;
+  int i = 0;
+  
+  while (i < len) {
+    if (format[i] == '%' && i + 1 < len && format[i+1] == '%') {
+      literal = true;
+      i += 2;
+    } else if (format[i] == '%') {
+      i++;
+      while (i < len && (format[i] == '*' || (format[i] >= '0' && format[i] <= '9'))) {
+        i++;
+      }
+      if (i < len && format[i] == '[') {
+        // The set may start with ']' or "^]"
+        i += (i + 1 < len && format[i+1] == '^') ? 3 : 2;
+        while (i < len && format[i] != ']') {
+          i++;
+        }
+      }
+      i++;
+      literal = false;
+    } else {
+      literal = !(format[i] == ' ' || format[i] == '\t' || format[i] == '\n' || format[i] == '\r');
+      i++;
+    }
+  }
+  return literal;
+}
+
+// Step the oob trie with character len of the current line and run the
+// callback whose prefix the line has just completed
+static int atparser_check_oob(ATCmdParser *self, char c, int len)
+{
+  const oob_node *node = (len == 1) ? self->_oob_root : self->_oob_node;
+  
+  if (node == NULL) {
+    // No prefix starts like this line
+    return OOB_NONE;
+  }
+  for (node = node->child; node && node->c != c; node = node->sibling) {
+  }
+  self->_oob_node = node;
+  
+  if (node == NULL || node->handler == NULL) {
+    return OOB_NONE;
+  }
+  oob *oob = node->handler;
+  AT_TRACE_EVENT(self, "[AT oob] ", oob->prefix, oob->len);
+  oob->cb(oob->param);
+  
+  if (self->_aborted) {
+    AT_TRACE_EVENT(self, "[AT aborted] ", "", 0);
+    if (self->_cmd) {
+      atparser_command_end(self, atparser_now() - self->_cmd_start);
+    }
+    atparser_rx_release(self);
+    return OOB_ABORTED;
+  }
+  return OOB_HANDLED;
 }
 
 void atparser_flush(ATCmdParser *self)
@@ -116,14 +410,29 @@ void atparser_flush(ATCmdParser *self)
 // read/write handling with timeouts
 int atparser_write(ATCmdParser *self, const char *data, int size)
 {
-  return ssUartWrite(self->_fd, (const uint8_t *)data, size);
+  struct iovec iov = { (void *)data, size };
+  
+  return self->_transport->writev(self->_transport_ctx, &iov, 1);
 }
 
 int atparser_read(ATCmdParser *self, char *data, int size)
 {
-  return ssUartRead(self->_fd, (uint8_t *)data, size, self->_timeout);
+  atparser_rx_release(self);
+  return atparser_copy_raw(self, data, size);
 }
 
+int atparser_read_counted(ATCmdParser *self, char *data, int size)
+{
+  // Give back the unparsed rest of the borrowed span, it is payload
+  atparser_rx_release(self);
+  
+  int count = atparser_copy_raw(self, data, size);
+  
+  // The payload's last byte must not pair with the CR/LF that follows it
+  self->_in_prev = 0;
+  
+  return count;
+}
 
 // printf/scanf handling
 int atparser_vprintf(ATCmdParser *self, const char *format, va_list args)
@@ -204,29 +513,205 @@ int atparser_vscanf(ATCmdParser *self, const char *format, va_list args)
 }
 
 
-// Command parsing with line handling
-bool atparser_vsend(ATCmdParser *self, const char *command, va_list args)
+/*------------------------- COMMAND LATENCY ----------------------------------*/
+
+static uint32_t atparser_now(void)
 {
-  // Create and send command
-  if (vsprintf(self->_buffer, command, args) < 0) {
-    return false;
+  return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+// Time the next read may wait: what is left of the command's timeout, if
+// it has one, else the parser timeout
+static uint32_t atparser_rx_timeout(ATCmdParser *self)
+{
+  if (self->_cmd_timeout) {
+    uint32_t elapsed = atparser_now() - self->_cmd_start;
+    return (elapsed < self->_cmd_timeout) ? self->_cmd_timeout - elapsed : 0;
+  }
+  return self->_timeout;
+}
+
+// Latency entry of a command, keyed by its name: "AT+UDNSRN=0,\"a.b\"" is
+// "AT+UDNSRN", "AT+COPS?" and "AT+COPS=?" keep their suffix
+static atparser_latency *atparser_latency_find(ATCmdParser *self, const char *command, bool create)
+{
+  atparser_latency *oldest = NULL;
+  int len = strcspn(command, "=;\r\n");
+  
+  if (command[len] == '=' && command[len + 1] == '?') {
+    len += 2;
+  }
+  if (len == 0) {
+    return NULL;
+  }
+  if (len >= ATPARSER_LATENCY_KEY_SIZE) {
+    len = ATPARSER_LATENCY_KEY_SIZE - 1;
   }
   
-  for (int i = 0; self->_buffer[i]; i++) {
-    if (atparser_putc(self, self->_buffer[i]) < 0) {
-      return false;
+  for (int i = 0; i < ATPARSER_LATENCY_COMMANDS; i++) {
+    atparser_latency *entry = &self->_latency[i];
+    if (strncmp(entry->cmd, command, len) == 0 && entry->cmd[len] == 0) {
+      return entry;
     }
+    if (!entry->fixed && (oldest == NULL || entry->used < oldest->used)) {
+      oldest = entry;
+    }
+  }
+  if (!create || oldest == NULL) {
+    return NULL;
   }
   
-  // Finish with newline
-  for (size_t i = 0; self->_output_delimiter[i]; i++) {
-    if (atparser_putc(self, self->_output_delimiter[i]) < 0) {
-      return false;
+  memset(oldest, 0, sizeof(*oldest));
+  memcpy(oldest->cmd, command, len);
+  return oldest;
+}
+
+static void atparser_latency_add(atparser_latency *entry, uint32_t latency)
+{
+  int k = 0;
+  
+  while (k < ATPARSER_LATENCY_BUCKETS - 1 && latency >= (1UL << k)) {
+    k++;
+  }
+  // Halving keeps the histogram following a modem that got slower or faster
+  if (entry->count >= ATPARSER_LATENCY_WINDOW) {
+    entry->count = 0;
+    for (int i = 0; i < ATPARSER_LATENCY_BUCKETS; i++) {
+      entry->buckets[i] /= 2;
+      entry->count += entry->buckets[i];
+    }
+  }
+  entry->buckets[k]++;
+  entry->count++;
+}
+
+// Upper bound of the bucket holding the 99th percentile, 0 while there are
+// too few samples
+static uint32_t atparser_latency_p99(const atparser_latency *entry)
+{
+  uint32_t rank = entry->count - entry->count / 100;
+  uint32_t seen = 0;
+  
+  if (entry->count < ATPARSER_LATENCY_SAMPLES) {
+    return 0;
+  }
+  for (int k = 0; k < ATPARSER_LATENCY_BUCKETS; k++) {
+    seen += entry->buckets[k];
+    if (seen >= rank) {
+      return 1UL << k;
     }
   }
+  return 1UL << (ATPARSER_LATENCY_BUCKETS - 1);
+}
+
+int atparser_command_timeout(ATCmdParser *self, const char *command, int limit)
+{
+  atparser_latency *entry = atparser_latency_find(self, command, false);
+  uint32_t p99 = (entry && !entry->fixed) ? atparser_latency_p99(entry) : 0;
+  uint32_t timeout = p99 * ATPARSER_TIMEOUT_FACTOR;
+  
+  if (p99 == 0) {
+    return limit;
+  }
+  if (timeout < ATPARSER_TIMEOUT_MIN) {
+    timeout = ATPARSER_TIMEOUT_MIN;
+  }
+  return (timeout < (uint32_t)limit) ? (int)timeout : limit;
+}
+
+bool atparser_command_fixed(ATCmdParser *self, const char *command)
+{
+  atparser_latency *entry = atparser_latency_find(self, command, true);
+  
+  if (entry == NULL) {
+    return false;
+  }
+  entry->fixed = true;
+  return true;
+}
+
+// The command in progress is over, took latency ms
+static void atparser_command_end(ATCmdParser *self, uint32_t latency)
+{
+  atparser_latency_add(self->_cmd, latency);
+  self->_cmd = NULL;
+  self->_cmd_timeout = 0;
+}
+
+// A response was matched; OK is the final one
+static void atparser_command_response(ATCmdParser *self, const char *line, int len)
+{
+  if (self->_cmd == NULL) {
+    return;
+  }
+  self->_cmd_seen = atparser_now() - self->_cmd_start;
+  if (len >= 2 && line[0] == 'O' && line[1] == 'K' && (len == 2 || line[2] == '\n')) {
+    atparser_command_end(self, self->_cmd_seen);
+  }
+}
+
+// An unexpected line ended; true if it is the final error of the command in
+// progress, so the response awaited will not come
+static bool atparser_command_failed(ATCmdParser *self, const char *line)
+{
+  if (self->_cmd == NULL ||
+      !(strncmp(line, "ERROR", 5) == 0 ||
+        strncmp(line, "+CME ERROR", 10) == 0 ||
+        strncmp(line, "+CMS ERROR", 10) == 0)) {
+    return false;
+  }
+  AT_TRACE_EVENT(self, "[AT failed] ", self->_cmd->cmd, strlen(self->_cmd->cmd));
+  atparser_command_end(self, atparser_now() - self->_cmd_start);
+  atparser_rx_release(self);
+  return true;
+}
+
+// Command parsing with line handling
+bool atparser_vsend(ATCmdParser *self, const char *command, va_list args)
+{
+  return atparser_vcommand(self, 0, command, args);
+}
+
+bool atparser_vcommand(ATCmdParser *self, int limit, const char *command, va_list args)
+{
+  struct iovec cmd[2];
+  int len;
+  
+  // A command that never got its final result is learned from its last
+  // response, if it had one
+  if (self->_cmd && self->_cmd_seen) {
+    atparser_command_end(self, self->_cmd_seen);
+  }
+  self->_cmd = NULL;
+  self->_cmd_timeout = 0;
+  
+  // Create and send command
+  len = vsprintf(self->_buffer, command, args);
+  if (len < 0) {
+    return false;
+  }
+  
+  // Command and newline go out as one write
+  cmd[0].iov_base = self->_buffer;
+  cmd[0].iov_len = len;
+  cmd[1].iov_base = (void *)self->_output_delimiter;
+  cmd[1].iov_len = self->_output_delim_size;
+  if (self->_transport->writev(self->_transport_ctx, cmd, 2) != cmd[0].iov_len + cmd[1].iov_len) {
+    return false;
+  }
   
   //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT> %s\n", self->_buffer);
-  ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, (const char *)self->_buffer, strlen(self->_buffer), "[AT send] ");
+  AT_TRACE_IO(self, "[AT send] ", self->_buffer, len);
+  
+  self->_cmd_start = atparser_now();
+  self->_cmd_seen = 0;
+  if (limit > 0) {
+    self->_cmd_timeout = atparser_command_timeout(self, self->_buffer, limit);
+  }
+  self->_cmd = atparser_latency_find(self, self->_buffer, true);
+  if (self->_cmd) {
+    self->_cmd->used = self->_cmd_start;
+  }
   return true;
 }
 
@@ -266,6 +751,17 @@ restart:
     self->_buffer[offset++] = 'n';
     self->_buffer[offset++] = 0;
     
+    // Received characters are checked against the literal start of the
+    // expected line as they arrive. A line that already differs is only
+    // collected up to its end. sscanf runs once per finished line, or for
+    // expectations without a trailing newline only when their final literal
+    // character arrives; one ending in a conversion is scanned once its
+    // line is complete and may match just the start of it.
+    int prefix = atparser_literal_prefix(response, i);
+    bool literal_only = !whole_line_wanted && prefix == i;
+    bool literal_end = !whole_line_wanted && atparser_literal_end(response, i);
+    bool viable = true;
+    
     //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT? %s\n", self->_buffer);
     // To workaround scanf's lack of error reporting, we actually
     // make two passes. One checks the validity with the modified
@@ -278,58 +774,63 @@ restart:
     
     while (true) {
       // Receive next character
-      int c = atparser_getc(self);
+      int c = atparser_getc_line(self);
       if (c < 0) {
         //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT(Timeout)\n");
         return false;
       }
-      // Simplify newlines (borrowed from retarget.cpp)
-      if ((c == CR && self->_in_prev != LF) ||
-          (c == LF && self->_in_prev != CR)) {
-            self->_in_prev = c;
-            c = '\n';
-          } else if ((c == CR && self->_in_prev == LF) ||
-                     (c == LF && self->_in_prev == CR)) {
-                       self->_in_prev = c;
-                       // onto next character
-                       continue;
-                     } else {
-                       self->_in_prev = c;
-                     }
       self->_buffer[offset + j++] = c;
       self->_buffer[offset + j] = 0;
       
+      if (j <= prefix && c != response[j - 1]) {
+        viable = false;
+      }
+      
       // Check for oob data
-      for (struct oob *oob = self->_oobs; oob; oob = oob->next) {
-        if ((unsigned)j == oob->len && memcmp(
-                                              oob->prefix, self->_buffer+offset, oob->len) == 0) {
-                                                ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT! %s\n", oob->prefix);
-                                                oob->cb(oob->param);
-                                                
-                                                if (self->_aborted) {
-                                                  ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT(Aborted)\n");
-                                                  return false;
-                                                }
-                                                // oob may have corrupted non-reentrant buffer,
-                                                // so we need to set it up again
-                                                goto restart;
-                                              }
+      switch (atparser_check_oob(self, c, j)) {
+      case OOB_ABORTED:
+        return false;
+      case OOB_HANDLED:
+        // oob may have corrupted non-reentrant buffer,
+        // so we need to set it up again
+        goto restart;
+      default:
+        break;
       }
       
       // Check for match
       int count = -1;
-      if (whole_line_wanted && c != '\n') {
+      if (!viable) {
+        // Line can no longer match, wait for the next one
+      } else if (whole_line_wanted) {
         // Don't attempt scanning until we get delimiter if they included it in format
         // This allows recv("Foo: %s\n") to work, and not match with just the first character of a string
         // (scanf does not itself match whitespace in its format string, so \n is not significant to it)
-      } else {
+        if (c == '\n') {
+          sscanf(self->_buffer+offset, self->_buffer, &count);
+        }
+      } else if (literal_only) {
+        // Plain text such as "OK" or a prompt, already compared above
+        if (j == prefix) {
+          count = j;
+        }
+      } else if (literal_end) {
+        if (j > prefix && c == response[i - 1]) {
+          sscanf(self->_buffer+offset, self->_buffer, &count);
+        }
+      } else if (c == '\n' || j+1 >= self->_buffer_size - offset) {
+        // Ends in a conversion, the rest of the line is not wanted
         sscanf(self->_buffer+offset, self->_buffer, &count);
+        if (count > 0) {
+          count = j;
+        }
       }
       
       // We only succeed if all characters in the response are matched
       if (count == j) {
         //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT= %s\n", self->_buffer+offset);
-        ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, self->_buffer+offset, strlen(self->_buffer+offset), "[AT recv] ");
+        AT_TRACE_IO(self, "[AT recv] ", self->_buffer+offset, j);
+        atparser_command_response(self, self->_buffer+offset, j);
         // Reuse the front end of the buffer
         memcpy(self->_buffer, response, i);
         self->_buffer[i] = 0;
@@ -346,14 +847,613 @@ restart:
       // running out of space usually means we ran into binary data
       if (c == '\n' || j+1 >= self->_buffer_size - offset) {
         //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT< %s", self->_buffer+offset);
+        if (c == '\n' && atparser_command_failed(self, self->_buffer+offset)) {
+          return false;
+        }
         j = 0;
+        viable = true;
+      }
+    }
+  }
+  
+  atparser_rx_release(self);
+  return true;
+}
+
+/*------------------------- COMPILED PATTERNS --------------------------------*/
+
+static bool atparser_is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool atparser_pattern_compile(atparser_pattern *pattern, const char *format)
+{
+  const char *p = format;
+  
+  memset(pattern, 0, sizeof(*pattern));
+  pattern->format = format;
+  
+  while (*p) {
+    if (pattern->op_count >= ATPARSER_PATTERN_MAX_OPS) {
+      return false;
+    }
+    atparser_op *op = &pattern->ops[pattern->op_count];
+    
+    if (atparser_is_space(*p)) {
+      op->type = ATPARSER_OP_SPACE;
+      while (atparser_is_space(*p)) {
+        if (*p == '\n') {
+          pattern->whole_line = true;
+        }
+        p++;
+      }
+      // A newline ends the line, nothing may follow it
+      if (pattern->whole_line && *p) {
+        return false;
+      }
+    } else if (p[0] == '%' && p[1] != '%') {
+      p++;
+      op->store = true;
+      if (*p == '*') {
+        op->store = false;
+        p++;
+      }
+      while (*p >= '0' && *p <= '9') {
+        op->len = op->len * 10 + (*p++ - '0');
+      }
+      if (*p == 'd') {
+        op->type = ATPARSER_OP_INT;
+        p++;
+      } else if (*p == 'u') {
+        op->type = ATPARSER_OP_UINT;
+        p++;
+      } else if (p[0] == '[' && p[1] == '^' && p[2] && p[3] == ']') {
+        op->type = ATPARSER_OP_STRING;
+        op->stop = p[2];
+        p += 4;
+      } else {
+        return false;
+      }
+      // Stored strings need a width to bound the copy
+      if (op->type == ATPARSER_OP_STRING && op->store && op->len == 0) {
+        return false;
+      }
+      if (op->store) {
+        if (pattern->field_count >= ATPARSER_PATTERN_MAX_FIELDS) {
+          return false;
+        }
+        pattern->field_count++;
+      }
+    } else {
+      op->type = ATPARSER_OP_LITERAL;
+      op->text = p;
+      if (p[0] == '%') {
+        // "%%" is a single literal percent sign
+        op->text = ++p;
+        op->len = 1;
+        p++;
+      } else {
+        while (*p && *p != '%' && !atparser_is_space(*p)) {
+          op->len++;
+          p++;
+        }
       }
     }
+    pattern->op_count++;
   }
   
+  // The end of a match must be recognisable without looking further
+  if (pattern->op_count == 0) {
+    return false;
+  }
+  uint8_t last = pattern->ops[pattern->op_count - 1].type;
+  return last == ATPARSER_OP_LITERAL || (last == ATPARSER_OP_SPACE && pattern->whole_line);
+}
+
+static void atparser_match_next(const atparser_pattern *pattern, atparser_match *match)
+{
+  const atparser_op *op = &pattern->ops[match->op];
+  
+  if (op->store) {
+    if (op->type != ATPARSER_OP_STRING) {
+      match->fields[match->field].value = match->negative ? -match->value : match->value;
+    }
+    match->field++;
+  }
+  match->op++;
+  match->pos = 0;
+  match->value = 0;
+  match->negative = false;
+}
+
+// Feed the last character of line[0..len) to the pattern
+static int atparser_pattern_feed(const atparser_pattern *pattern, atparser_match *match,
+                                 const char *line, int len)
+{
+  char c = line[len - 1];
+  
+  while (match->op < pattern->op_count) {
+    const atparser_op *op = &pattern->ops[match->op];
+    
+    switch (op->type) {
+    case ATPARSER_OP_LITERAL:
+      if (c != op->text[match->pos]) {
+        return MATCH_FAIL;
+      }
+      if (++match->pos == op->len) {
+        atparser_match_next(pattern, match);
+      }
+      goto consumed;
+      
+    case ATPARSER_OP_SPACE:
+      if (atparser_is_space(c)) {
+        goto consumed;
+      }
+      atparser_match_next(pattern, match);
+      continue;
+      
+    case ATPARSER_OP_INT:
+    case ATPARSER_OP_UINT:
+      if (match->pos == 0 && !match->negative) {
+        // scanf skips whitespace before a number
+        if (atparser_is_space(c)) {
+          goto consumed;
+        }
+        if (c == '-' && op->type == ATPARSER_OP_INT && match->value == 0) {
+          match->negative = true;
+          goto consumed;
+        }
+      }
+      if (c >= '0' && c <= '9' && (op->len == 0 || match->pos < op->len)) {
+        match->value = match->value * 10 + (c - '0');
+        match->pos++;
+        goto consumed;
+      }
+      if (match->pos == 0) {
+        return MATCH_FAIL;
+      }
+      atparser_match_next(pattern, match);
+      continue;
+      
+    case ATPARSER_OP_STRING:
+      if (c != op->stop && (op->len == 0 || match->pos < op->len)) {
+        if (match->pos == 0 && op->store) {
+          match->fields[match->field].start = len - 1;
+        }
+        match->pos++;
+        if (op->store) {
+          match->fields[match->field].len = match->pos;
+        }
+        goto consumed;
+      }
+      if (match->pos == 0) {
+        return MATCH_FAIL;
+      }
+      atparser_match_next(pattern, match);
+      continue;
+      
+    default:
+      return MATCH_FAIL;
+    }
+  }
+  // Pattern already complete, the character is not part of it
+  return MATCH_FAIL;
+  
+consumed:
+  if (match->op == pattern->op_count) {
+    return MATCH_DONE;
+  }
+  // Trailing newline of a whole line pattern
+  if (pattern->whole_line && c == '\n' && match->op == pattern->op_count - 1) {
+    return MATCH_DONE;
+  }
+  return MATCH_MORE;
+}
+
+static void atparser_pattern_store(const atparser_pattern *pattern, const atparser_match *match,
+                                   const char *line, va_list args)
+{
+  int field = 0;
+  
+  for (int i = 0; i < pattern->op_count; i++) {
+    const atparser_op *op = &pattern->ops[i];
+    
+    if (!op->store) {
+      continue;
+    }
+    switch (op->type) {
+    case ATPARSER_OP_INT:
+      *va_arg(args, int *) = match->fields[field].value;
+      break;
+    case ATPARSER_OP_UINT:
+      *va_arg(args, unsigned *) = (unsigned)match->fields[field].value;
+      break;
+    case ATPARSER_OP_STRING:
+      {
+        char *dst = va_arg(args, char *);
+        memcpy(dst, line + match->fields[field].start, match->fields[field].len);
+        dst[match->fields[field].len] = 0;
+      }
+      break;
+    default:
+      break;
+    }
+    field++;
+  }
+}
+
+// Receive until a line matches pattern; the line is left in _buffer.
+// Returns its length, 0 on timeout or abort.
+static int atparser_recv_match(ATCmdParser *self, const atparser_pattern *pattern, atparser_match *match)
+{
+  bool viable;
+  int j;
+  
+restart:
+  self->_aborted = false;
+  memset(match, 0, sizeof(*match));
+  viable = true;
+  j = 0;
+  
+  while (true) {
+    // Receive next character
+    int c = atparser_getc_line(self);
+    if (c < 0) {
+      return 0;
+    }
+    self->_buffer[j++] = c;
+    self->_buffer[j] = 0;
+    
+    // Check for oob data
+    switch (atparser_check_oob(self, c, j)) {
+    case OOB_ABORTED:
+      return 0;
+    case OOB_HANDLED:
+      goto restart;
+    default:
+      break;
+    }
+    
+    if (viable) {
+      int result = atparser_pattern_feed(pattern, match, self->_buffer, j);
+      if (result == MATCH_DONE) {
+        AT_TRACE_IO(self, "[AT recv] ", self->_buffer, j);
+        atparser_command_response(self, self->_buffer, j);
+        atparser_rx_release(self);
+        return j;
+      }
+      viable = (result == MATCH_MORE);
+    }
+    
+    // Clear the buffer when we hit a newline or ran out of space
+    if (c == '\n' && atparser_command_failed(self, self->_buffer)) {
+      return 0;
+    }
+    if (c == '\n' || j+1 >= self->_buffer_size) {
+      memset(match, 0, sizeof(*match));
+      viable = true;
+      j = 0;
+    }
+  }
+}
+
+bool atparser_vrecv_pattern(ATCmdParser *self, const atparser_pattern *pattern, va_list args)
+{
+  atparser_match match;
+  
+  if (atparser_recv_match(self, pattern, &match) == 0) {
+    return false;
+  }
+  atparser_pattern_store(pattern, &match, self->_buffer, args);
   return true;
 }
 
+bool atparser_pattern_parse(const atparser_pattern *pattern, const char *line, ...)
+{
+  atparser_match match;
+  int len = strlen(line);
+  
+  memset(&match, 0, sizeof(match));
+  for (int j = 1; j <= len; j++) {
+    int result = atparser_pattern_feed(pattern, &match, line, j);
+    if (result == MATCH_DONE) {
+      va_list args;
+      va_start(args, line);
+      atparser_pattern_store(pattern, &match, line, args);
+      va_end(args);
+      return true;
+    }
+    if (result == MATCH_FAIL) {
+      break;
+    }
+  }
+  return false;
+}
+
+/*------------------------- SCRIPTS ------------------------------------------*/
+
+// Join the leading concatenable steps into line. Returns how many were
+// joined, 1 when the first step has to go on its own.
+static int atparser_script_group(const atparser_step *steps, int count, char *line, int size)
+{
+  int n = 0;
+  int len = 0;
+  
+  while (n < count && steps[n].response == NULL &&
+         (n == 0 || (steps[n - 1].flags & ATPARSER_STEP_CONCAT))) {
+    // Later commands drop their "AT", "AT+A;+B" is the concatenated form
+    const char *cmd = (n == 0) ? steps[n].cmd : steps[n].cmd + 2;
+    int needed = strlen(cmd) + (n > 0 ? 1 : 0);
+    
+    if (n > 0 && strncasecmp(steps[n].cmd, "AT", 2) != 0) {
+      break;
+    }
+    if (len + needed >= size) {
+      break;
+    }
+    if (n > 0) {
+      line[len++] = ';';
+    }
+    strcpy(&line[len], cmd);
+    len += strlen(cmd);
+    n++;
+  }
+  
+  return (n > 1) ? n : 1;
+}
+
+static bool atparser_script_step(ATCmdParser *self, const atparser_step *step, int limit)
+{
+  bool success = false;
+  
+  for (int attempt = 0; !success && attempt <= step->retries; attempt++) {
+    if (attempt > 0 && step->retry_delay) {
+      vTaskDelay(pdMS_TO_TICKS(step->retry_delay));
+    }
+    success = atparser_command(self, limit, "%s", step->cmd) &&
+      (step->response == NULL || atparser_recv(self, step->response, step->capture)) &&
+        atparser_recv(self, "OK");
+  }
+  
+  return success;
+}
+
+int atparser_run_script(ATCmdParser *self, const atparser_step *steps, int count)
+{
+  char line[ATPARSER_SCRIPT_LINE_SIZE];
+  int i = 0;
+  
+  while (i < count) {
+    int n = atparser_script_group(&steps[i], count - i, line, sizeof(line));
+    
+    if (n > 1) {
+      // One round trip for the whole group, waiting as long as its slowest step
+      int group_timeout = 0;
+      for (int k = i; k < i + n; k++) {
+        if (steps[k].timeout > group_timeout) {
+          group_timeout = steps[k].timeout;
+        }
+      }
+      if (atparser_command(self, group_timeout ? group_timeout : self->_timeout, "%s", line) &&
+          atparser_recv(self, "OK")) {
+        i += n;
+        continue;
+      }
+      // Find out which step the modem did not like
+    }
+    
+    if (!atparser_script_step(self, &steps[i], steps[i].timeout ? steps[i].timeout : self->_timeout) &&
+        !(steps[i].flags & ATPARSER_STEP_OPTIONAL)) {
+      ssLoggingPrint(ESsLoggingLevel_Warning, 0, "AT script failed at %s", steps[i].cmd);
+      break;
+    }
+    i++;
+  }
+  
+  return i;
+}
+
+/*------------------------- TRACE --------------------------------------------*/
+
+#if ATPARSER_TRACE_LEVEL > ATPARSER_TRACE_NONE
+
+#define ATPARSER_TRACE_TASK_NAME    "AtTrace"
+
+typedef struct atparser_trace_entry {
+  const char *tag;            // string literal, not copied
+  uint8_t len;
+  char data[ATPARSER_TRACE_DATA_SIZE];
+} atparser_trace_entry;
+
+static QueueHandle_t atparser_trace_queue = NULL;
+static volatile uint32_t atparser_trace_dropped = 0;
+
+// Hand data to the trace task, never blocking the caller
+static void atparser_trace(ATCmdParser *self, const char *tag, const char *data, int len)
+{
+  atparser_trace_entry entry;
+  
+  if (!self->_dbg_on) {
+    return;
+  }
+  if (atparser_trace_queue == NULL) {
+    ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, data, len, "%s", tag);
+    return;
+  }
+  
+  entry.tag = tag;
+  do {
+    entry.len = (len < (int)sizeof(entry.data)) ? len : sizeof(entry.data);
+    memcpy(entry.data, data, entry.len);
+    if (xQueueSend(atparser_trace_queue, &entry, 0) != pdTRUE) {
+      atparser_trace_dropped++;
+      return;
+    }
+    data += entry.len;
+    len -= entry.len;
+  } while (len > 0);
+}
+
+static void atparser_trace_task(void *param)
+{
+  QueueHandle_t queue = (QueueHandle_t)param;
+  atparser_trace_entry entry;
+  uint32_t reported = 0;
+  
+  for (;;) {
+    xQueueReceive(queue, &entry, portMAX_DELAY);
+    
+    if (atparser_trace_dropped != reported) {
+      reported = atparser_trace_dropped;
+      ssLoggingPrint(ESsLoggingLevel_Warning, 0, "AT trace dropped %lu entries", (unsigned long)reported);
+    }
+    ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, entry.data, entry.len, "%s", entry.tag);
+  }
+}
+
+#endif
+
+bool atparser_trace_start(uint16_t stack_size, uint32_t priority)
+{
+#if ATPARSER_TRACE_LEVEL > ATPARSER_TRACE_NONE
+  QueueHandle_t queue;
+  
+  if (atparser_trace_queue != NULL) {
+    return true;
+  }
+  
+  queue = xQueueCreate(ATPARSER_TRACE_QUEUE_LENGTH, sizeof(atparser_trace_entry));
+  if (queue == NULL) {
+    return false;
+  }
+  if (xTaskCreate(atparser_trace_task, ATPARSER_TRACE_TASK_NAME,
+                  stack_size, queue, priority, NULL) != pdPASS) {
+    vQueueDelete(queue);
+    return false;
+  }
+  // Traces are queued only once the task is there to read them
+  atparser_trace_queue = queue;
+#else
+  (void)stack_size;
+  (void)priority;
+#endif
+  return true;
+}
+
+/*------------------------- COMMAND ENGINE -----------------------------------*/
+
+bool atparser_engine_start(ATCmdParser *self, void (*lock)(void), void (*unlock)(void),
+                           uint16_t stack_size, uint32_t priority)
+{
+  if (self->_engine_queue != NULL) {
+    return true;
+  }
+  
+  self->_engine_lock = lock;
+  self->_engine_unlock = unlock;
+  self->_engine_queue = xQueueCreate(ATPARSER_ENGINE_QUEUE_LENGTH, sizeof(atparser_request));
+  if (self->_engine_queue == NULL) {
+    return false;
+  }
+  
+  if (xTaskCreate(atparser_engine_task, ATPARSER_ENGINE_TASK_NAME,
+                  stack_size, self, priority, (TaskHandle_t *)&self->_engine_task) != pdPASS) {
+    vQueueDelete(self->_engine_queue);
+    self->_engine_queue = NULL;
+    return false;
+  }
+  return true;
+}
+
+void atparser_engine_stop(ATCmdParser *self)
+{
+  QueueHandle_t queue = (QueueHandle_t)self->_engine_queue;
+  atparser_request request;
+  
+  if (queue == NULL) {
+    return;
+  }
+  
+  // An empty command asks the engine to quit once the current one is done
+  memset(&request, 0, sizeof(request));
+  request.ctx = xTaskGetCurrentTaskHandle();
+  xQueueSendToFront(queue, &request, portMAX_DELAY);
+  while (self->_engine_task != NULL) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  self->_engine_queue = NULL;
+  
+  while (xQueueReceive(queue, &request, 0) == pdTRUE) {
+    if (request.callback) {
+      request.callback(request.ctx, false, "");
+    }
+  }
+  vQueueDelete(queue);
+}
+
+bool atparser_submit(ATCmdParser *self, const char *cmd, const atparser_pattern *response,
+                     int timeout, atparser_callback callback, void *ctx)
+{
+  atparser_request request;
+  
+  if (self->_engine_queue == NULL || cmd[0] == 0 || strlen(cmd) >= sizeof(request.cmd)) {
+    return false;
+  }
+  
+  strcpy(request.cmd, cmd);
+  request.response = response;
+  request.timeout = timeout;
+  request.callback = callback;
+  request.ctx = ctx;
+  
+  return xQueueSend(self->_engine_queue, &request, 0) == pdTRUE;
+}
+
+static void atparser_engine_task(void *param)
+{
+  ATCmdParser *self = (ATCmdParser *)param;
+  atparser_request request;
+  atparser_match match;
+  char response[ATPARSER_RESPONSE_SIZE];
+  
+  for (;;) {
+    xQueueReceive(self->_engine_queue, &request, portMAX_DELAY);
+    if (request.cmd[0] == 0) {
+      // Stop request, the stopping task owns the queue from here on
+      self->_engine_task = NULL;
+      xTaskNotifyGive((TaskHandle_t)request.ctx);
+      vTaskDelete(NULL);
+    }
+    
+    if (self->_engine_lock) {
+      self->_engine_lock();
+    }
+    response[0] = 0;
+    bool success = atparser_command(self, request.timeout, "%s", request.cmd);
+    if (success && request.response) {
+      int len = atparser_recv_match(self, request.response, &match);
+      if (len >= (int)sizeof(response)) {
+        len = sizeof(response) - 1;
+      }
+      memcpy(response, self->_buffer, len);
+      response[len] = 0;
+      success = (len > 0);
+    }
+    if (success) {
+      success = atparser_recv(self, "OK");
+    }
+    
+    if (self->_engine_unlock) {
+      self->_engine_unlock();
+    }
+    
+    if (request.callback) {
+      request.callback(request.ctx, success, response);
+    }
+  }
+}
+
 // Mapping to vararg functions
 int atparser_printf(ATCmdParser *self, const char *format, ...)
 {
@@ -382,6 +1482,15 @@ bool atparser_send(ATCmdParser *self, const char *command, ...)
   return res;
 }
 
+bool atparser_command(ATCmdParser *self, int limit, const char *command, ...)
+{
+  va_list args;
+  va_start(args, command);
+  bool res = atparser_vcommand(self, limit, command, args);
+  va_end(args);
+  return res;
+}
+
 bool atparser_recv(ATCmdParser *self, const char *response, ...)
 {
   va_list args;
@@ -391,16 +1500,60 @@ bool atparser_recv(ATCmdParser *self, const char *response, ...)
   return res;
 }
 
+bool atparser_recv_pattern(ATCmdParser *self, const atparser_pattern *pattern, ...)
+{
+  va_list args;
+  va_start(args, pattern);
+  bool res = atparser_vrecv_pattern(self, pattern, args);
+  va_end(args);
+  return res;
+}
+
+static void atparser_oob_free(oob_node *node)
+{
+  while (node) {
+    oob_node *sibling = node->sibling;
+    atparser_oob_free(node->child);
+    free(node);
+    node = sibling;
+  }
+}
+
 // oob registration
 void atparser_oob(ATCmdParser *self, const char *prefix, void (*cb)(void *), void *param)
 {
   struct oob *oob = malloc(sizeof(struct oob));
+  assert(oob);
   oob->len = strlen(prefix);
   oob->prefix = prefix;
   oob->cb = cb;
   oob->param = param;
   oob->next = self->_oobs;
   self->_oobs = oob;
+  
+  if (self->_oob_root == NULL) {
+    self->_oob_root = calloc(1, sizeof(oob_node));
+    assert(self->_oob_root);
+  }
+  
+  // Add the prefix to the trie, sharing the nodes of common leading characters
+  oob_node *node = self->_oob_root;
+  for (const char *p = prefix; *p; p++) {
+    oob_node *child = node->child;
+    while (child && child->c != *p) {
+      child = child->sibling;
+    }
+    if (child == NULL) {
+      child = calloc(1, sizeof(oob_node));
+      assert(child);
+      child->c = *p;
+      child->sibling = node->child;
+      node->child = child;
+    }
+    node = child;
+  }
+  // Latest registration of a prefix wins, as it did with the list
+  node->handler = oob;
 }
 
 void atparser_abort(ATCmdParser *self)
@@ -414,10 +1567,14 @@ bool atparser_process_oob(ATCmdParser *self)
   //    return false;
   //}
   
+  // Unsolicited data is read with the parser timeout, whatever is left of
+  // a command deadline does not apply to it
+  self->_cmd_timeout = 0;
+  
   int i = 0;
   while (true) {
-    // Receive next character
-    int c = atparser_getc(self);
+    // Receive next character, same line handling as atparser_vrecv
+    int c = atparser_getc_line(self);
     if (c < 0) {
       return false;
     }
@@ -425,23 +1582,16 @@ bool atparser_process_oob(ATCmdParser *self)
     self->_buffer[i] = 0;
     
     // Check for oob data
-    struct oob *oob = self->_oobs;
-    while (oob) {
-      if (i == (int)oob->len && memcmp(
-                                       oob->prefix, self->_buffer, oob->len) == 0) {
-                                         ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT! %s\r\n", oob->prefix);
-                                         oob->cb(oob->param);
-                                         return true;
-                                       }
-      oob = oob->next;
+    if (atparser_check_oob(self, c, i) != OOB_NONE) {
+      atparser_rx_release(self);
+      return true;
     }
     
     // Clear the buffer when we hit a newline or ran out of space
     // running out of space usually means we ran into binary data
-    if (i+1 >= self->_buffer_size ||
-        strcmp(&self->_buffer[i-self->_output_delim_size], self->_output_delimiter) == 0) {
+    if (i+1 >= self->_buffer_size || c == '\n') {
           
-          ssLoggingPrint(ESsLoggingLevel_Debug, 0, "AT< %s", self->_buffer);
+          AT_TRACE_EVENT(self, "[AT skip] ", self->_buffer, i);
           i = 0;
         }
   }
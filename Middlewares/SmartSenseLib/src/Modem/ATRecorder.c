@@ -0,0 +1,129 @@
+/**
+* @file
+* @brief    AT traffic recorder
+* @warning
+* @details
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+/*------------------------- INCLUDED FILES ************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "ssLogging.h"
+#include "ATTransport.h"
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+/* log lines carry at most this many bytes, longer chunks are split */
+#define ATREC_LOG_CHUNK   64
+
+/*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
+
+static uint32_t atparser_recorder_peek(void *ctx, const uint8_t **data, uint32_t timeout);
+static void atparser_recorder_consume(void *ctx, uint32_t size);
+static uint32_t atparser_recorder_writev(void *ctx, const struct iovec *iov, uint32_t count);
+
+/*------------------------- PUBLIC VARIABLES ---------------------------------*/
+
+const atparser_transport atparser_recorder_transport = {
+  atparser_recorder_peek,
+  atparser_recorder_consume,
+  atparser_recorder_writev,
+};
+
+/*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
+
+static uint32_t atparser_recorder_now(atparser_recorder *recorder)
+{
+  return xTaskGetTickCount() * portTICK_PERIOD_MS - recorder->start;
+}
+
+static void atparser_recorder_emit(atparser_recorder *recorder, uint8_t dir,
+                                   const uint8_t *data, uint32_t len)
+{
+  atparser_record record;
+
+  if (!len) {
+    return;
+  }
+  record.time = atparser_recorder_now(recorder);
+  record.dir = dir;
+  record.len = len;
+  record.data = data;
+  recorder->sink(recorder->sink_ctx, &record);
+}
+
+static uint32_t atparser_recorder_peek(void *ctx, const uint8_t **data, uint32_t timeout)
+{
+  atparser_recorder *recorder = ctx;
+  uint32_t size = recorder->inner->peek(recorder->inner_ctx, data, timeout);
+
+  recorder->span = size ? *data : NULL;
+  return size;
+}
+
+/* Received bytes are recorded as the parser consumes them, so a peek that
+ * is only partly consumed is not reported twice */
+static void atparser_recorder_consume(void *ctx, uint32_t size)
+{
+  atparser_recorder *recorder = ctx;
+
+  if (recorder->span) {
+    atparser_recorder_emit(recorder, ATPARSER_RECORD_RX, recorder->span, size);
+    recorder->span += size;
+  }
+  recorder->inner->consume(recorder->inner_ctx, size);
+}
+
+static uint32_t atparser_recorder_writev(void *ctx, const struct iovec *iov, uint32_t count)
+{
+  atparser_recorder *recorder = ctx;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    atparser_recorder_emit(recorder, ATPARSER_RECORD_TX, iov[i].iov_base, iov[i].iov_len);
+  }
+  return recorder->inner->writev(recorder->inner_ctx, iov, count);
+}
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+void atparser_recorder_start(atparser_recorder *recorder, ATCmdParser *parser,
+                             atparser_record_sink sink, void *sink_ctx)
+{
+  recorder->inner = atparser_get_transport(parser, &recorder->inner_ctx);
+  recorder->sink = sink;
+  recorder->sink_ctx = sink_ctx;
+  recorder->start = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  recorder->span = NULL;
+  atparser_set_transport(parser, &atparser_recorder_transport, recorder);
+}
+
+void atparser_recorder_stop(atparser_recorder *recorder, ATCmdParser *parser)
+{
+  atparser_set_transport(parser, recorder->inner, recorder->inner_ctx);
+}
+
+void atparser_recorder_log_sink(void *ctx, const atparser_record *record)
+{
+  const uint8_t *data = record->data;
+  uint32_t len = record->len;
+
+  (void)ctx;
+  while (len) {
+    uint32_t chunk = len < ATREC_LOG_CHUNK ? len : ATREC_LOG_CHUNK;
+
+    ssLoggingPrintRawStr(ESsLoggingLevel_Debug, LOGGING_NO_CATEGORY,
+                         (const char *)data, chunk,
+                         "ATREC %lu %c", (unsigned long)record->time, record->dir);
+    data += chunk;
+    len -= chunk;
+  }
+}
@@ -0,0 +1,271 @@
+/**
+* @file
+* @brief    AT transcript replay
+* @warning
+* @details
+*
+* Plain C without RTOS calls, so a parser on the replay transport runs on a
+* host as well as on the target. Time is virtual: delivering a record moves
+* the clock to the record time and a peek with nothing to deliver moves it
+* by the timeout, so timeouts cost nothing and every run is identical.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+/*------------------------- INCLUDED FILES ************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "ATTransport.h"
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+#define ATREC_TAG         "ATREC "
+
+/*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
+
+static uint32_t atparser_replay_peek(void *ctx, const uint8_t **data, uint32_t timeout);
+static void atparser_replay_consume(void *ctx, uint32_t size);
+static uint32_t atparser_replay_writev(void *ctx, const struct iovec *iov, uint32_t count);
+
+/*------------------------- PUBLIC VARIABLES ---------------------------------*/
+
+const atparser_transport atparser_replay_transport = {
+  atparser_replay_peek,
+  atparser_replay_consume,
+  atparser_replay_writev,
+};
+
+/*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
+
+/* First record at or after index going in direction dir */
+static uint32_t atparser_replay_skip(const atparser_replay *replay, uint32_t index, uint8_t dir)
+{
+  while (index < replay->count && replay->records[index].dir != dir) {
+    index++;
+  }
+  return index;
+}
+
+static void atparser_replay_advance(atparser_replay *replay, uint32_t time)
+{
+  if (replay->clock < time) {
+    replay->clock = time;
+  }
+}
+
+static uint32_t atparser_replay_peek(void *ctx, const uint8_t **data, uint32_t timeout)
+{
+  atparser_replay *replay = ctx;
+  const atparser_record *record;
+
+  // the modem answers only what it has been sent
+  if (replay->rx_next >= replay->count || replay->tx_next < replay->rx_next) {
+    replay->timeouts++;
+    replay->clock += timeout;
+    return 0;
+  }
+  record = &replay->records[replay->rx_next];
+  atparser_replay_advance(replay, record->time);
+  *data = record->data + replay->rx_offset;
+  return record->len - replay->rx_offset;
+}
+
+static void atparser_replay_consume(void *ctx, uint32_t size)
+{
+  atparser_replay *replay = ctx;
+
+  if (replay->rx_next >= replay->count) {
+    return;
+  }
+  replay->rx_offset += size;
+  if (replay->rx_offset >= replay->records[replay->rx_next].len) {
+    replay->rx_offset = 0;
+    replay->rx_next = atparser_replay_skip(replay, replay->rx_next + 1, ATPARSER_RECORD_RX);
+  }
+}
+
+static uint32_t atparser_replay_writev(void *ctx, const struct iovec *iov, uint32_t count)
+{
+  atparser_replay *replay = ctx;
+  uint32_t total = 0;
+  uint32_t i, j;
+
+  for (i = 0; i < count; i++) {
+    const uint8_t *data = iov[i].iov_base;
+
+    for (j = 0; j < iov[i].iov_len; j++) {
+      const atparser_record *record;
+
+      if (replay->tx_next >= replay->count) {
+        replay->mismatches++;
+        continue;
+      }
+      record = &replay->records[replay->tx_next];
+      atparser_replay_advance(replay, record->time);
+      if (record->data[replay->tx_offset] != data[j]) {
+        replay->mismatches++;
+      }
+      if (++replay->tx_offset >= record->len) {
+        replay->tx_offset = 0;
+        replay->tx_next = atparser_replay_skip(replay, replay->tx_next + 1, ATPARSER_RECORD_TX);
+      }
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+static int atparser_replay_hex(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Undo the escaping of ssLoggingPrintRawStr, text points past the opening
+ * quote. Returns the number of bytes stored, at most len. */
+static uint32_t atparser_replay_unescape(const char *text, uint8_t *out, uint32_t len)
+{
+  uint32_t n = 0;
+
+  while (n < len && *text && *text != '"' && *text != '\n') {
+    char c = *text++;
+
+    if (c == '\\') {
+      c = *text++;
+      switch (c) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 't': c = '\t'; break;
+        case 'n': c = '\n'; break;
+        case 'v': c = '\v'; break;
+        case 'f': c = '\f'; break;
+        case 'r': c = '\r'; break;
+        case 'x': {
+          int hi = atparser_replay_hex(text[0]);
+          int lo = hi < 0 ? -1 : atparser_replay_hex(text[1]);
+
+          if (lo < 0) {
+            return n;
+          }
+          c = (char)(hi << 4 | lo);
+          text += 2;
+          break;
+        }
+        case '"':
+        case '\\':
+          break;
+        default:
+          return n;
+      }
+    }
+    out[n++] = (uint8_t)c;
+  }
+  return n;
+}
+
+/* Parse one "ATREC <time> <T|R> <len> "<data>"" line ending at end into record */
+static bool atparser_replay_parse(const char *line, const char *end, atparser_record *record)
+{
+  unsigned long time;
+  unsigned len;
+  char dir;
+  const char *quote;
+  uint8_t *data;
+
+  line = strstr(line, ATREC_TAG);
+  if (!line || (end && line > end) ||
+      sscanf(line + sizeof(ATREC_TAG) - 1, "%lu %c %u", &time, &dir, &len) != 3 ||
+      (dir != ATPARSER_RECORD_TX && dir != ATPARSER_RECORD_RX) ||
+      len == 0 || len > UINT16_MAX) {
+    return false;
+  }
+  quote = strchr(line, '"');
+  if (!quote) {
+    return false;
+  }
+  data = malloc(len);
+  if (!data) {
+    return false;
+  }
+  if (atparser_replay_unescape(quote + 1, data, len) != len) {
+    free(data);
+    return false;
+  }
+  record->time = time;
+  record->dir = dir;
+  record->len = len;
+  record->data = data;
+  return true;
+}
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+void atparser_replay_init(atparser_replay *replay, atparser_record *records, uint32_t count)
+{
+  memset(replay, 0, sizeof(*replay));
+  replay->records = records;
+  replay->count = count;
+  replay->rx_next = atparser_replay_skip(replay, 0, ATPARSER_RECORD_RX);
+  replay->tx_next = atparser_replay_skip(replay, 0, ATPARSER_RECORD_TX);
+}
+
+uint32_t atparser_replay_load(atparser_replay *replay, const char *text)
+{
+  atparser_record *records;
+  const char *line;
+  uint32_t lines = 0;
+  uint32_t count = 0;
+
+  for (line = text; (line = strstr(line, ATREC_TAG)) != NULL; line++) {
+    lines++;
+  }
+  records = lines ? malloc(lines * sizeof(*records)) : NULL;
+  if (!records) {
+    atparser_replay_init(replay, NULL, 0);
+    return 0;
+  }
+
+  for (line = text; *line && count < lines; ) {
+    const char *end = strchr(line, '\n');
+
+    if (atparser_replay_parse(line, end, &records[count])) {
+      count++;
+    }
+    if (!end) {
+      break;
+    }
+    line = end + 1;
+  }
+
+  atparser_replay_init(replay, records, count);
+  replay->owned = true;
+  return count;
+}
+
+void atparser_replay_free(atparser_replay *replay)
+{
+  uint32_t i;
+
+  if (replay->owned) {
+    for (i = 0; i < replay->count; i++) {
+      free((void *)replay->records[i].data);
+    }
+    free(replay->records);
+  }
+  atparser_replay_init(replay, NULL, 0);
+}
+
+bool atparser_replay_done(const atparser_replay *replay)
+{
+  return replay->rx_next >= replay->count && replay->tx_next >= replay->count;
+}
@@ -58,7 +58,14 @@ typedef struct
 
 static ssGNSSConfigDataType *GNSSConfigData;
 
+/* ssGNSSdeinit waits for the readers to leave before it frees anything */
+static volatile bool GNSSStopping = false;
+static volatile uint32_t GNSSReaders = 0;
+
 /*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
+static bool ssGNSSReaderEnter(void);
+static void ssGNSSReaderExit(void);
+static bool ssGNSSGetLine(void);
 
 /*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
 uint8_t ssGNSSinit(USART_TypeDef *USARTx, uint32_t flags)
@@ -72,6 +79,7 @@ uint8_t ssGNSSinit(USART_TypeDef *USARTx, uint32_t flags)
     config.Parity = GNSS_UART_PARITY;
     config.StopBits = GNSS_UART_STOPBITS;
     config.WordLength = GNSS_UART_WORDLENGTH;
+    config.DmaMode = SS_UART_DMA_RX;
 
     GNSSConfigData = pvPortMalloc(sizeof(ssGNSSConfigDataType));
     configASSERT(GNSSConfigData);
@@ -87,21 +95,58 @@ uint8_t ssGNSSinit(USART_TypeDef *USARTx, uint32_t flags)
     return SS_GNSS_STATUS_OK;
 }
 
+/* Readers still running are stopped first: ssGNSSRead returns,
+ * ssGNSSGetCoords and ssGNSSGetTime return false */
+void ssGNSSdeinit(void)
+{
+    if(GNSSConfigData != NULL)
+    {
+        GNSSStopping = true;
+        while(GNSSReaders > 0)
+        {
+            /* wakes a reader waiting for a line, one between two lines
+             * sees the flag before it waits again */
+            ssUartWaitCancel(GNSSConfigData->uartId);
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        HAL_GPIO_WritePin(GNSS_EN_GPIO_Port, GNSS_EN_Pin, GPIO_PIN_RESET);
+
+        ssUartClose(GNSSConfigData->uartId);
+        vPortFree(GNSSConfigData);
+        GNSSConfigData = NULL;
+        GNSSStopping = false;
+    }
+}
+
 void ssGNSSRead(void)
 {
-    while(1)
+    if(!ssGNSSReaderEnter())
+    {
+        return;
+    }
+    while(ssGNSSGetLine())
     {
-      ssUartGets(GNSSConfigData->uartId, GNSSConfigData->buffer, USART_BUFFER_SIZE, GNSS_UART_TIMEOUT);
       ssLoggingPrint(ESsLoggingLevel_Info, 0, "%s", GNSSConfigData->buffer);
     }
+    ssGNSSReaderExit();
 } 
 
 bool ssGNSSGetCoords(struct ssGNSScoords *coords)
 {
+    if(!ssGNSSReaderEnter())
+    {
+        return false;
+    }
     do
     {
-      ssUartGets(GNSSConfigData->uartId, GNSSConfigData->buffer, USART_BUFFER_SIZE, GNSS_UART_TIMEOUT);
+      if(!ssGNSSGetLine())
+      {
+        ssGNSSReaderExit();
+        return false;
+      }
     } while(sscanf((char const *)GNSSConfigData->buffer, "$GNGLL,%f,%*c,%f,", &(coords->lat), &(coords->lon)) != 2);
+    ssGNSSReaderExit();
     
     coords->lat = TO_DECIMAL(coords->lat);
     coords->lon = TO_DECIMAL(coords->lon);
@@ -116,9 +161,18 @@ bool ssGNSSGetTime(char *datetime, size_t size)
     char time[7];
     char date[7];
     char *p;
+    if(!ssGNSSReaderEnter())
+    {
+        return false;
+    }
     do {
-        ssUartGets(GNSSConfigData->uartId, GNSSConfigData->buffer, USART_BUFFER_SIZE, GNSS_UART_TIMEOUT);
+        if(!ssGNSSGetLine())
+        {
+            ssGNSSReaderExit();
+            return false;
+        }
     } while(sscanf((char const *)GNSSConfigData->buffer, "$GNRMC,%6[0-9].%*d,%*c,%*f,%*c,%*f,%*c,%*f,,%6[0-9]*", time, date) != 2);
+    ssGNSSReaderExit();
     
     p = time;
     for (uint8_t i = 0; i < 20; i++)
@@ -192,3 +246,38 @@ uint64_t datetime_to_timestamp(const char *datetime)
 
     return seconds;
 }
+
+/*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
+
+/* Register a reader, false if the module is not initialised or stopping */
+static bool ssGNSSReaderEnter(void)
+{
+    bool ok;
+
+    taskENTER_CRITICAL();
+    ok = (GNSSConfigData != NULL) && !GNSSStopping;
+    if(ok)
+    {
+        GNSSReaders++;
+    }
+    taskEXIT_CRITICAL();
+    return ok;
+}
+
+static void ssGNSSReaderExit(void)
+{
+    taskENTER_CRITICAL();
+    GNSSReaders--;
+    taskEXIT_CRITICAL();
+}
+
+/* Read the next line into the buffer, false once ssGNSSdeinit stops us */
+static bool ssGNSSGetLine(void)
+{
+    if(GNSSStopping)
+    {
+        return false;
+    }
+    ssUartGets(GNSSConfigData->uartId, GNSSConfigData->buffer, USART_BUFFER_SIZE, GNSS_UART_TIMEOUT);
+    return !GNSSStopping;
+}
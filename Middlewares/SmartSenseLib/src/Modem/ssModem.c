@@ -24,6 +24,7 @@
 #include "arpa/inet.h"
 
 #include "cmsis_os.h"
+#include "event_groups.h"
 
 #include "hal_modem.h"
 
@@ -31,6 +32,7 @@
 #include "ssLogging.h"
 #include "ssSocket.h"  
 #include "ATCmdParser.h"
+#include "fifo.h"
 #include "ssDevMan.h"
 #include "ssModem.h"
 
@@ -41,11 +43,11 @@
 
 #define AT_PARSER_TIMEOUT       5000 // Milliseconds
 
-#define UNNATURAL_STRING "\x01"
-
 #define u_stringify(a) str(a)
 #define str(a) #a
 
+#define COUNT_OF(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
 /** Socket timeout value in milliseconds.
 * Note: the sockets layer above will retry the
 * call to the functions here when they return NSAPI_ERROR_WOULD_BLOCK
@@ -64,15 +66,150 @@
 #define MAX_READ_SIZE 1024
 
 #define MODEM_TIMEOUT_DEFAULT 1000
-#define RECV_TASK_TIMEOUT     1/portTICK_PERIOD_MS  // Merkat experimenting with value
+
+#define MODEM_UART_BAUDRATE   115200  // link speed after power up
+#define MODEM_IPR_SETTLE_TIME 100     // ms the modem needs after AT+IPR before the new rate is used
+#define MODEM_IPR_TIMEOUT     200     // AT timeout while probing a new link speed
+#define MODEM_UART_BUFFER_SIZE 1024
+
+#define MODEM_URC_TASK_STACK_SIZE  384   // also issues AT+USORD/AT+USORF to prefetch socket data
+#define MODEM_URC_TASK_PRIORITY    3
+#define MODEM_URC_TASK_NAME        "ModemUrc"
+#define MODEM_URC_LINE_TIMEOUT     10    // ms allowed for the rest of a URC line once it started
+
+#define MODEM_AT_ENGINE_STACK_SIZE 512
+#define MODEM_AT_ENGINE_PRIORITY   2
+
+#define MODEM_AT_TRACE_STACK_SIZE  384
+#define MODEM_AT_TRACE_PRIORITY    1     // traces are printed when nothing else runs
+
+#define MODEM_DNS_TIMEOUT          60000 // AT+UDNSRN can take much longer than other commands
+
+// Resolved names are kept for a fixed time, AT+UDNSRN does not report the record TTL
+#ifndef MODEM_DNS_CACHE_SIZE
+#define MODEM_DNS_CACHE_SIZE       4
+#endif
+#ifndef MODEM_DNS_TTL
+#define MODEM_DNS_TTL              300000 // ms a resolved address is used
+#endif
+#ifndef MODEM_DNS_NEGATIVE_TTL
+#define MODEM_DNS_NEGATIVE_TTL     10000  // ms a failed lookup is not repeated
+#endif
+#ifndef MODEM_DNS_REFRESH_AHEAD
+#define MODEM_DNS_REFRESH_AHEAD    30000  // ms before expiry a hit queues a refresh, 0 disables
+#endif
+
+// The command engine must take a lookup of the longest name
+#if ATPARSER_CMD_SIZE < MODEM_DNS_NAME_SIZE + 14
+#error "ATPARSER_CMD_SIZE too small for AT+UDNSRN of MODEM_DNS_NAME_SIZE"
+#endif
+
+#define MODEM_SOCKET_READ_TIMEOUT  1000  // AT+USORD/AT+USORF including the payload
+#define MODEM_COPS_TIMEOUT         1000  // AT+COPS? sometimes leaves out the status field
+#define MODEM_PROMPT_GUARD_SARA_U2 50    // ms SARA-U2 needs between the '@' prompt and the data
+#define MODEM_UPSD_CMD_SIZE        128   // AT+UPSD with an APN of up to 99 characters
+
+#define MODEM_REGISTER_TIMEOUT     180000 // ms modem_nwk_register waits for the network
+#define MODEM_REG_URC_SIZE         48     // longest +CGREG line: n, stat, lac, ci, AcT and rac
+
+// Registration event bits, one per domain
+#define MODEM_REG_CSD              (1 << 0)
+#define MODEM_REG_PSD              (1 << 1)
+#define MODEM_REG_EPS              (1 << 2)
+#define MODEM_REG_ROAMING          (1 << 3)   // registered on a visited network
+#define MODEM_REG_ANY              (MODEM_REG_CSD | MODEM_REG_PSD | MODEM_REG_EPS)
+#define MODEM_REG_ALL              (MODEM_REG_ANY | MODEM_REG_ROAMING)
 
 /*------------------------- TYPE DEFINITIONS ---------------------------------*/
 
+typedef struct modem_dns_request
+{
+  modem_dns_callback callback;
+  void *ctx;
+  char host[MODEM_DNS_NAME_SIZE];   // cache key
+} modem_dns_request;
+
+typedef struct modem_dns_entry
+{
+  char host[MODEM_DNS_NAME_SIZE];   // empty if the entry is free
+  uint32_t address;
+  int32_t status;                   // 0 or the failure being cached
+  TickType_t expires;
+  bool refreshing;                  // a lookup is queued on the AT engine
+} modem_dns_entry;
+
+// Users of the AT channel, a higher class is served first
+typedef enum
+{
+  MODEM_PRIO_IDLE = 0,    // reader task listening for URCs
+  MODEM_PRIO_CONTROL,     // network, identity and DNS requests
+  MODEM_PRIO_SOCKET,      // socket commands and data prefetch
+} modem_prio;
+
+// Task waiting for the AT channel, lives on the waiter's stack
+typedef struct modem_waiter
+{
+  TaskHandle_t task;
+  UBaseType_t task_prio;      // task priority when it queued, lent to the holder
+  uint8_t prio;
+  volatile bool granted;
+  struct modem_waiter *next;
+} modem_waiter;
+
+// Precedes every datagram in the receive ring of a UDP socket
+typedef struct modem_datagram
+{
+  uint16_t len;
+  uint16_t port;
+  char addr[SOCK_IP_SIZE + 1];
+} modem_datagram;
+
+// A UDP ring must hold the largest datagram one AT+USORF returns
+#define MODEM_UDP_RX_SIZE (MAX_READ_SIZE + sizeof(modem_datagram))
+
 
 /*------------------------- PUBLIC VARIABLES ---------------------------------*/
 
 /*------------------------- PRIVATE VARIABLES --------------------------------*/
-SemaphoreHandle_t mtx;
+
+// AT channel arbitration: the holder runs one exchange, then the channel
+// goes to the first waiter, queued by class and in arrival order within one
+static bool channel_busy = false;
+static modem_waiter *channel_queue = NULL;
+static volatile uint32_t channel_waiters = 0;   // waiters other than the reader task
+
+// The class queue replaces a mutex, so the holder inherits the priority
+// of its highest waiting task by hand
+static TaskHandle_t channel_holder = NULL;
+static UBaseType_t channel_holder_prio = 0;     // the holder's own task priority
+static UBaseType_t channel_holder_lent = 0;     // priority lent to it, 0 if none
+
+// Reader task that owns the AT channel while no command is in progress
+static TaskHandle_t urc_task = NULL;
+static int urc_fd = -1;
+static modem_waiter urc_waiter;
+
+// Registration state published by the +CREG/+CGREG/+CEREG handlers
+static EventGroupHandle_t reg_events = NULL;
+
+// Link speeds tried with AT+IPR, fastest first
+static const uint32_t link_speeds[] =
+{
+  921600,
+  460800,
+  230400
+};
+
+// Responses on the socket data paths, compiled once in modem_create
+static atparser_pattern usord_pattern;
+static atparser_pattern usorf_pattern;
+static atparser_pattern prompt_pattern;
+static atparser_pattern ok_pattern;
+static atparser_pattern udnsrn_pattern;
+
+// Recent lookups, accessed in critical sections only
+static modem_dns_entry dns_cache[MODEM_DNS_CACHE_SIZE];
+
 const char *ran_type_name_table[] =
 {
   "GSM",
@@ -90,6 +227,8 @@ const char *ran_type_name_table[] =
 /*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
 bool power_up(modem_t *self);
 bool reset(modem_t *self);
+bool set_link_speed(modem_t *self);
+bool verify_link_speed(modem_t *self, uint32_t baudrate);
 
 bool init_sim_card(modem_t *self);
 bool set_device_identity(modem_t *self);
@@ -108,27 +247,198 @@ bool is_registered_eps(modem_t *self);
 
 void set_rat(modem_t *self, int AcTStatus);
 void set_nwk_reg_status_csd(modem_t *self, int status);
+void set_nwk_reg_status_psd(modem_t *self, int status);
+void set_nwk_reg_status_eps(modem_t *self, int status);
 
 int read_at_to_char(modem_t *self, char * buf, int size, char end);
 void parser_abort_cb(void *param);
 
 void CMX_ERROR_URC(void *param);
 void CREG_URC(void *param);
+void CGREG_URC(void *param);
+void CEREG_URC(void *param);
 void UUSORD_URC(void *param);
 void UUSORF_URC(void *param);
 void UUSOCL_URC(void *param);
 
+static void modem_channel_take(modem_waiter *waiter, uint8_t prio);
+static void modem_channel_grant(modem_waiter *waiter);
+static void modem_channel_inherit(const modem_waiter *waiter);
+static void modem_channel_enqueue(modem_waiter *waiter);
+static bool modem_channel_dequeue(modem_waiter *waiter);
+static void LOCK_SOCKET(void);
+static bool modem_reg_parse(char *line, int *status, int *act);
+static void modem_reg_publish(modem_t *self);
+static void modem_urc_start(modem_t *self);
+static void modem_dns_done(void *ctx, bool success, const char *response);
+static bool modem_dns_cache_lookup(const char *host, int32_t *status, uint32_t *address,
+                                   bool *refresh);
+static void modem_dns_cache_store(const char *host, int32_t status, uint32_t address);
+static void modem_dns_cache_refresh_failed(const char *host);
+static bool modem_dns_submit(modem_t *self, const char *host, modem_dns_callback callback, void *ctx);
+static void modem_urc_task(void *param);
+static bool modem_socket_wanted(modem_t *self);
+static bool modem_socket_prefetch(modem_t *self);
+static bool modem_socket_fill(modem_t *self, int socket);
+static uint32_t modem_socket_block(SockCtrl *sock);
+static FifoHandle_t modem_socket_reader_enter(SockCtrl *sock);
+static void modem_socket_reader_exit(SockCtrl *sock);
+static void modem_socket_release_rx(SockCtrl *sock);
+static void modem_socket_prefetch_kick(modem_t *self, int socket);
+static int32_t modem_socket_read_datagram(FifoHandle_t rx, void *buffer, size_t length,
+                                          struct SocketAddress_in *address);
+static bool modem_socket_write(modem_t *self, const char *buf, size_t blk);
+
 
 /*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
 
+// Queue a waiter behind those of its class and above. Call in a critical section.
+static void modem_channel_enqueue(modem_waiter *waiter)
+{
+  modem_waiter **link = &channel_queue;
+  
+  while ((*link != NULL) && ((*link)->prio >= waiter->prio))
+  {
+    link = &(*link)->next;
+  }
+  waiter->next = *link;
+  *link = waiter;
+  if (waiter != &urc_waiter)
+  {
+    channel_waiters++;
+  }
+}
+
+// Take a waiter out of the queue if it is there. Call in a critical section.
+static bool modem_channel_dequeue(modem_waiter *waiter)
+{
+  modem_waiter **link = &channel_queue;
+  
+  while ((*link != NULL) && (*link != waiter))
+  {
+    link = &(*link)->next;
+  }
+  if (*link == NULL)
+  {
+    return false;
+  }
+  *link = waiter->next;
+  if (waiter != &urc_waiter)
+  {
+    channel_waiters--;
+  }
+  return true;
+}
+
+// Make a waiter the holder of the channel. Call in a critical section.
+static void modem_channel_grant(modem_waiter *waiter)
+{
+  channel_holder = waiter->task;
+  channel_holder_prio = waiter->task_prio;
+  channel_holder_lent = 0;
+  waiter->granted = true;
+}
+
+// Raise the holder to the priority of a task waiting for the channel, so a
+// task of middle priority cannot keep both of them off the CPU. The idle
+// reader only wants the channel when nobody else does and lends nothing.
+// Call in a critical section, the switch it may cause is taken on leaving it.
+static void modem_channel_inherit(const modem_waiter *waiter)
+{
+  UBaseType_t prio = waiter->task_prio;
+  
+  if ((waiter->prio > MODEM_PRIO_IDLE) && (prio > channel_holder_prio) && (prio > channel_holder_lent))
+  {
+    channel_holder_lent = prio;
+    vTaskPrioritySet(channel_holder, prio);
+  }
+}
+
+static void modem_channel_take(modem_waiter *waiter, uint8_t prio)
+{
+  waiter->task = xTaskGetCurrentTaskHandle();
+  waiter->task_prio = uxTaskPriorityGet(NULL);
+  waiter->prio = prio;
+  waiter->granted = false;
+  
+  taskENTER_CRITICAL();
+  if (!channel_busy)
+  {
+    channel_busy = true;
+    modem_channel_grant(waiter);
+  }
+  else
+  {
+    modem_channel_enqueue(waiter);
+    modem_channel_inherit(waiter);
+  }
+  taskEXIT_CRITICAL();
+  
+  if (!waiter->granted && (urc_task != NULL))
+  {
+    // The reader task keeps the channel while it is idle, make it let go
+    ssUartWaitCancel(urc_fd);
+  }
+  // Other notifications (fifo wake-ups) may arrive meanwhile, hence the flag
+  while (!waiter->granted)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+}
+
 static void LOCK()
 {
-  xSemaphoreTake(mtx, portMAX_DELAY);
+  modem_waiter waiter;
+  
+  modem_channel_take(&waiter, MODEM_PRIO_CONTROL);
+}
+
+static void LOCK_SOCKET(void)
+{
+  modem_waiter waiter;
+  
+  modem_channel_take(&waiter, MODEM_PRIO_SOCKET);
 }
 
 static void UNLOCK()
 {
-  xSemaphoreGive(mtx);
+  modem_waiter *next;
+  TaskHandle_t next_task = NULL;
+  UBaseType_t own_prio;
+  bool lent;
+  
+  taskENTER_CRITICAL();
+  own_prio = channel_holder_prio;
+  lent = (channel_holder_lent != 0);
+  next = channel_queue;
+  if (next != NULL)
+  {
+    modem_channel_dequeue(next);
+    // The waiter lives on its task's stack and may be gone once granted
+    next_task = next->task;
+    // The channel stays busy, it passes straight to the next holder
+    modem_channel_grant(next);
+    for (modem_waiter *waiter = channel_queue; waiter != NULL; waiter = waiter->next)
+    {
+      modem_channel_inherit(waiter);
+    }
+  }
+  else
+  {
+    channel_busy = false;
+    channel_holder = NULL;
+  }
+  taskEXIT_CRITICAL();
+  
+  if (next_task != NULL)
+  {
+    xTaskNotifyGive(next_task);
+  }
+  // Only once the next holder is on its way, or a middle task could delay it
+  if (lent)
+  {
+    vTaskPrioritySet(NULL, own_prio);
+  }
 }
 
 modem_t *modem_create(void)
@@ -143,14 +453,16 @@ modem_t *modem_create(void)
   
   hal_modem_init();
   
-  config.baudrate = 115200;
+  config.baudrate = MODEM_UART_BAUDRATE;
   config.FlowControl = UART_HWCONTROL_RTS_CTS;
   config.Mode = UART_MODE_TX_RX;
   config.Parity = UART_PARITY_NONE;
   config.StopBits = UART_STOPBITS_1;
   config.WordLength = UART_WORDLENGTH_8B;
-  modem->fd = ssUartOpen(USART3, &config, 1024);
+  config.DmaMode = SS_UART_DMA_RX | SS_UART_DMA_TX;
+  modem->fd = ssUartOpen(USART3, &config, MODEM_UART_BUFFER_SIZE);
   configASSERT(modem->fd >= 0);
+  modem->baudrate = MODEM_UART_BAUDRATE;
   
   modem->at = atparser_create(modem->fd);
   assert(modem->at);
@@ -158,6 +470,11 @@ modem_t *modem_create(void)
   modem->at_timeout = MODEM_TIMEOUT_DEFAULT;
   atparser_set_timeout(modem->at, modem->at_timeout);
   
+  // Their latency is the network's, they always get their whole limit
+  atparser_command_fixed(modem->at, "AT+UDNSRN");
+  atparser_command_fixed(modem->at, "AT+USORD");
+  atparser_command_fixed(modem->at, "AT+USORF");
+  
   modem->sim_pin_enabled = false;
   modem->pin = NULL;
   
@@ -167,11 +484,21 @@ modem_t *modem_create(void)
   modem->uname = NULL;
   modem->pwd = NULL;
   
+  modem->dev_info.rat = RAN_TYPE_LAST;
+  modem->dev_info.reg_status_csd = CSD_NOT_REGISTERED_NOT_SEARCHING;
+  modem->dev_info.reg_status_psd = PSD_NOT_REGISTERED_NOT_SEARCHING;
+  modem->dev_info.reg_status_eps = EPS_NOT_REGISTERED_NOT_SEARCHING;
+  
+  reg_events = xEventGroupCreate();
+  assert(reg_events);
+  
   for(int i=0; i<SOCKET_COUNT; i++)
   {
     modem->sockets[i].state = SOCKET_CLOSED;
     modem->sockets[i].pending = 0;
-    modem->sockets[i].buffer = NULL;
+    modem->sockets[i].protocol = 0;
+    modem->sockets[i].rx = NULL;
+    modem->sockets[i].readers = 0;
   }
   
   // Error cases, out of band handling
@@ -181,20 +508,45 @@ modem_t *modem_create(void)
   
   // Registration status, out of band handling
   atparser_oob(modem->at, "+CREG", CREG_URC, modem);
+  atparser_oob(modem->at, "+CGREG", CGREG_URC, modem);
+  atparser_oob(modem->at, "+CEREG", CEREG_URC, modem);
   
   atparser_oob(modem->at, "+UUSORD", UUSORD_URC, modem);
   atparser_oob(modem->at, "+UUSORF", UUSORF_URC, modem);
   atparser_oob(modem->at, "+UUSOCL", UUSOCL_URC, modem);
   
-  mtx = xSemaphoreCreateMutex();
+  bool compiled = atparser_pattern_compile(&usord_pattern, "+USORD: %*d,%u,\"") &&
+    atparser_pattern_compile(&usorf_pattern, "+USORF: %*d,\"%" u_stringify(SOCK_IP_SIZE) "[^\"]\",%d,%u,\"") &&
+      atparser_pattern_compile(&prompt_pattern, "@") &&
+        atparser_pattern_compile(&ok_pattern, "OK") &&
+          atparser_pattern_compile(&udnsrn_pattern, "+UDNSRN: \"%" u_stringify(SOCK_IP_SIZE) "[^\"]\"");
+  assert(compiled);
   
   return modem;
 }
 
 void modem_destroy(modem_t *self)
 {
+  // Queued requests complete here, the engine needs the channel for the current one
+  atparser_engine_stop(self->at);
+  if (urc_task != NULL)
+  {
+    LOCK();
+    taskENTER_CRITICAL();
+    modem_channel_dequeue(&urc_waiter);
+    taskEXIT_CRITICAL();
+    vTaskDelete(urc_task);
+    urc_task = NULL;
+    UNLOCK();
+  }
+  for (int i = 0; i < SOCKET_COUNT; i++)
+  {
+    modem_socket_release_rx(&self->sockets[i]);
+  }
+  vEventGroupDelete(reg_events);
+  reg_events = NULL;
   atparser_destroy(self->at);
-  //ssUartClose(self->fd);
+  ssUartClose(self->fd);
   vPortFree(self);
 }
 
@@ -204,16 +556,23 @@ bool modem_init(modem_t *self, const char *pin)
   self->pin = pin;
   if(!self->modem_initialised)
   {
+    assert(atparser_trace_start(MODEM_AT_TRACE_STACK_SIZE, MODEM_AT_TRACE_PRIORITY));
     assert(reset(self));
+    if(self->baudrate != MODEM_UART_BAUDRATE)
+    {
+      // IPR is not stored (no AT&W), the modem comes back at the default rate
+      ssUartSetBaudrate(self->fd, MODEM_UART_BAUDRATE);
+      self->baudrate = MODEM_UART_BAUDRATE;
+    }
     assert(power_up(self));
+    assert(set_link_speed(self));
     assert(init_sim_card(self));
     assert(set_device_identity(self));
     assert(device_init(self));
-    assert(device_init(self));
-    assert(get_imsi(self));
-    assert(get_imei(self));
-    assert(get_meid(self));
     self->modem_initialised = true;
+    modem_urc_start(self);
+    assert(atparser_engine_start(self->at, LOCK, UNLOCK,
+                                 MODEM_AT_ENGINE_STACK_SIZE, MODEM_AT_ENGINE_PRIORITY));
   }
   
   return self->modem_initialised;
@@ -221,7 +580,6 @@ bool modem_init(modem_t *self, const char *pin)
 
 bool modem_nwk_register(modem_t *self)
 {
-  bool atSuccess = false;
   bool registered = false;
   int status;
   LOCK();
@@ -229,69 +587,64 @@ bool modem_nwk_register(modem_t *self)
   if (!is_registered_psd(self) && !is_registered_csd(self) && !is_registered_eps(self))
   {
     ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Searching Network...");
-    // Enable the packet switched and network registration unsolicited result codes
-    if (atparser_send(self->at, "AT+CREG=1") && atparser_recv(self->at, "OK") &&
-        atparser_send(self->at, "AT+CGREG=1") && atparser_recv(self->at, "OK"))
+    // Enable the registration unsolicited result codes, with location
+    // and access technology so a change of network is seen from the URC
+    if (atparser_send(self->at, "AT+CREG=2") && atparser_recv(self->at, "OK") &&
+        atparser_send(self->at, "AT+CGREG=2") && atparser_recv(self->at, "OK"))
     {
-      atSuccess = true;
-      if (atparser_send(self->at, "AT+CEREG=1"))
+      if (atparser_send(self->at, "AT+CEREG=2"))
       {
         atparser_recv(self->at, "OK");
         // Don't check return value as this works for LTE only
       }
       
-      if (atSuccess)
+      // See if we are already in automatic mode
+      if (atparser_send(self->at, "AT+COPS?") && atparser_recv(self->at, "+COPS: %d", &status) &&
+          atparser_recv(self->at, "OK"))
       {
-        // See if we are already in automatic mode
-        if (atparser_send(self->at, "AT+COPS?") && atparser_recv(self->at, "+COPS: %d", &status) &&
-            atparser_recv(self->at, "OK"))
+        // If not, set it
+        if (status != 0)
         {
-          // If not, set it
-          if (status != 0)
+          /* Don't check return code here as there's not much
+             we can do if this fails. */
+          // @TODO> add error handling
+          if(atparser_send(self->at, "AT+COPS=0"))
           {
-            /* Don't check return code here as there's not much
-               we can do if this fails. */
-        	// @TODO> add error handling
-            if(atparser_send(self->at, "AT+COPS=0"))
-            {
-              atparser_recv(self->at, "OK");
-            }
+            atparser_recv(self->at, "OK");
           }
         }
-        
-        // Query the registration status directly as well,
-        // just in case
-        if (atparser_send(self->at, "AT+CREG?") && atparser_recv(self->at, "OK")) {
-          // Answer will be processed by URC
-        }
-        if (atparser_send(self->at, "AT+CGREG?") && atparser_recv(self->at, "OK")) {
-          // Answer will be processed by URC
-        }
-        if (atparser_send(self->at, "AT+CEREG?")) {
-          atparser_recv(self->at, "OK");
-          // Don't check return value as this works for LTE only
-        }
+      }
+      
+      // Query the registration status directly as well, the modem
+      // may have registered before the URCs were enabled
+      if (atparser_send(self->at, "AT+CREG?") && atparser_recv(self->at, "OK")) {
+        // Answer will be processed by URC
+      }
+      if (atparser_send(self->at, "AT+CGREG?") && atparser_recv(self->at, "OK")) {
+        // Answer will be processed by URC
+      }
+      if (atparser_send(self->at, "AT+CEREG?")) {
+        atparser_recv(self->at, "OK");
+        // Don't check return value as this works for LTE only
       }
     }
-    // Wait for registration to succeed
-    atparser_set_timeout(self->at, 1000);
-    for (int waitSeconds = 0; !registered && (waitSeconds < 180); waitSeconds++)
-    {
-      registered = is_registered_psd(self) || is_registered_csd(self) || is_registered_eps(self);
-      atparser_recv(self->at, UNNATURAL_STRING);
-    }
-    atparser_set_timeout(self->at, self->at_timeout);
     
-    if (registered)
+    // The channel is free while waiting, the reader task dispatches
+    // the registration URCs and they wake us up
+    UNLOCK();
+    registered = modem_nwk_wait_registered(self, MODEM_REGISTER_TIMEOUT);
+    LOCK();
+    
+    if (registered && (self->dev_info.rat == RAN_TYPE_LAST))
     {
-      // This should return quickly but sometimes the status field is not returned
-      // so make the timeout short
-      atparser_set_timeout(self->at, 1000);
-      if (atparser_send(self->at, "AT+COPS?") && atparser_recv(self->at, "+COPS: %*d,%*d,\"%*[^\"]\",%d\n", &status))
+      // No access technology in the URCs, ask the operator selection.
+      // This should return quickly but sometimes the status field is not
+      // returned so make the timeout short
+      if (atparser_command(self->at, MODEM_COPS_TIMEOUT, "AT+COPS?") &&
+          atparser_recv(self->at, "+COPS: %*d,%*d,\"%*[^\"]\",%d\n", &status))
       {
         set_rat(self, status);
       }
-      atparser_set_timeout(self->at, self->at_timeout);
     }
   } else
   {
@@ -302,6 +655,16 @@ bool modem_nwk_register(modem_t *self)
   return registered;
 }
 
+// Block until the modem is registered in any domain or timeout ms passed.
+bool modem_nwk_wait_registered(modem_t *self, uint32_t timeout)
+{
+  EventBits_t bits;
+  
+  bits = xEventGroupWaitBits(reg_events, MODEM_REG_ANY, pdFALSE, pdFALSE,
+                             pdMS_TO_TICKS(timeout));
+  return (bits & MODEM_REG_ANY) != 0;
+}
+
 // Perform deregistration.
 bool modem_nwk_deregister(modem_t *self)
 {
@@ -312,6 +675,7 @@ bool modem_nwk_deregister(modem_t *self)
     self->dev_info.reg_status_csd = CSD_NOT_REGISTERED_NOT_SEARCHING;
     self->dev_info.reg_status_psd = PSD_NOT_REGISTERED_NOT_SEARCHING;
     self->dev_info.reg_status_eps = EPS_NOT_REGISTERED_NOT_SEARCHING;
+    modem_reg_publish(self);
     success = true;
   }
   
@@ -383,16 +747,27 @@ int32_t modem_gethostbyname(modem_t *self,
                             uint32_t *address)
 {
   int32_t status = -1;
-  int at_timeout;
   char ipAddress[SOCK_IP_SIZE] = {0};
+  bool refresh;
   
+  if (strlen(host) >= MODEM_DNS_NAME_SIZE)
+  {
+    return status;
+  }
+  if (modem_dns_cache_lookup(host, &status, address, &refresh))
+  {
+    // Renew the entry in the background, this caller keeps the cached answer
+    if (refresh && !modem_dns_submit(self, host, NULL, NULL))
+    {
+      modem_dns_cache_refresh_failed(host);
+    }
+    return status;
+  }
   
   LOCK();
   // This interrogation can sometimes take longer than the usual 8 seconds
-  at_timeout = self->at_timeout;
-  atparser_set_timeout(self->at, 60000);
   memset (ipAddress, 0, sizeof (ipAddress)); // Ensure terminator
-  if (atparser_send(self->at, "AT+UDNSRN=0,\"%s\"", host) &&
+  if (atparser_command(self->at, MODEM_DNS_TIMEOUT, "AT+UDNSRN=0,\"%s\"", host) &&
       atparser_recv(self->at, "+UDNSRN: \"%" u_stringify(SOCK_IP_SIZE) "[^\"]\"", ipAddress) &&
         atparser_recv(self->at, "OK"))
   {
@@ -403,16 +778,78 @@ int32_t modem_gethostbyname(modem_t *self,
       status = 0;
     }
   }
-  atparser_set_timeout(self->at, at_timeout);
   UNLOCK();
   
+  modem_dns_cache_store(host, status, (status == 0) ? *address : 0);
   return status;
 }
 
+// Answer from the cache when it can, callback then runs before this returns.
+// Otherwise queue the lookup on the AT engine; callback runs in the engine
+// task once the modem answers, so the caller never waits for the network.
+// The answer also goes to the cache.
+bool modem_gethostbyname_async(modem_t *self,
+                               const char *host,
+                               modem_dns_callback callback,
+                               void *ctx)
+{
+  int32_t status = -1;
+  uint32_t address = 0;
+  bool refresh;
+  
+  if (strlen(host) >= MODEM_DNS_NAME_SIZE)
+  {
+    return false;
+  }
+  if (modem_dns_cache_lookup(host, &status, &address, &refresh))
+  {
+    if (refresh && !modem_dns_submit(self, host, NULL, NULL))
+    {
+      modem_dns_cache_refresh_failed(host);
+    }
+    if (callback)
+    {
+      callback(ctx, status, address);
+    }
+    return true;
+  }
+  
+  return modem_dns_submit(self, host, callback, ctx);
+}
+
+// Queue a lookup on the AT engine, modem_dns_done completes it
+static bool modem_dns_submit(modem_t *self, const char *host, modem_dns_callback callback, void *ctx)
+{
+  char cmd[ATPARSER_CMD_SIZE];
+  modem_dns_request *request;
+  
+  if (snprintf(cmd, sizeof(cmd), "AT+UDNSRN=0,\"%s\"", host) >= (int)sizeof(cmd))
+  {
+    return false;
+  }
+  
+  request = pvPortMalloc(sizeof(modem_dns_request));
+  if (request == NULL)
+  {
+    return false;
+  }
+  request->callback = callback;
+  request->ctx = ctx;
+  strcpy(request->host, host);
+  
+  if (!atparser_submit(self->at, cmd, &udnsrn_pattern, MODEM_DNS_TIMEOUT, modem_dns_done, request))
+  {
+    vPortFree(request);
+    return false;
+  }
+  return true;
+}
+
 // Create a socket.
 int modem_socket_open(modem_t *self, int protocol)
 {
   int socket = SOCKET_INVALID;
+  uint32_t rx_size = SOCKET_BUF_SIZE;
   
   /* we support only udp and tcp protocols */
   if(protocol != IPPROTO_TCP &&
@@ -421,12 +858,18 @@ int modem_socket_open(modem_t *self, int protocol)
     return -1;
   }
   
-  LOCK();
+  LOCK_SOCKET();
   
   /* Merkat temp fix for waakama compatibility */
   if (protocol == 0)
     protocol = IPPROTO_UDP;
   
+  // Datagrams are never split, the ring takes a whole one
+  if ((protocol == IPPROTO_UDP) && (rx_size < MODEM_UDP_RX_SIZE))
+  {
+    rx_size = MODEM_UDP_RX_SIZE;
+  }
+  
   if (atparser_send(self->at, "AT+USOCR=%d", protocol))
   {
     if (atparser_recv(self->at, "+USOCR: %d\n", &socket) && (socket != SOCKET_INVALID) &&
@@ -435,8 +878,10 @@ int modem_socket_open(modem_t *self, int protocol)
       ssLoggingPrint(ESsLoggingLevel_Info, 0, "Socket %d was created", socket);
       self->sockets[socket].state = SOCKET_OPENED;
       self->sockets[socket].pending = 0;
-      self->sockets[socket].buffer = NULL;
-      
+      self->sockets[socket].protocol = protocol;
+      // A socket the remote end closed may still hold unread data
+      modem_socket_release_rx(&self->sockets[socket]);
+      self->sockets[socket].rx = fifo_create(NULL, rx_size);
     }
   }
   
@@ -448,13 +893,16 @@ int modem_socket_open(modem_t *self, int protocol)
 bool modem_socket_close(modem_t *self, int socket)
 {
   bool success = false;
-  LOCK();
+  LOCK_SOCKET();
   
   if (atparser_send(self->at, "AT+USOCL=%d", socket))
   {
     if (atparser_recv(self->at, "OK"))
     {
       ssLoggingPrint(ESsLoggingLevel_Info, 0, "Socket %d was closed", socket);
+      self->sockets[socket].state = SOCKET_CLOSED;
+      self->sockets[socket].pending = 0;
+      modem_socket_release_rx(&self->sockets[socket]);
       success = true;
     }
     else
@@ -474,7 +922,7 @@ disable hex mode -- option = 0
 bool modem_set_hex_mode(modem_t *self, uint8_t option)
 {
   bool success = false;
-  LOCK();
+  LOCK_SOCKET();
   
   if (atparser_send(self->at, "AT+UDCONF=%d", option))
   {
@@ -511,8 +959,6 @@ int16_t modem_socket_sendto(modem_t *self,
   
   /* @TODO: check if socket is open */
   
-  LOCK();
-  
   if (length > MAX_WRITE_SIZE) {
     ssLoggingPrint(ESsLoggingLevel_Warning, 0, "WARNING: packet length %d is too big for one UDP packet (max %d), will be fragmented.", length, MAX_WRITE_SIZE);
   }
@@ -522,37 +968,20 @@ int16_t modem_socket_sendto(modem_t *self,
       blk = count;
     }
     
-    if (atparser_send(self->at, "AT+USOST=%d,\"%s\",%d,%d", socket,
-                      dest_addr->sin_addr, dest_addr->sin_port, blk) &&
-        atparser_recv(self->at, "@")) {
-          osDelay(50); // Merkat changed from 200 to 100
-          int temp;
-          temp = atparser_write(self->at, buf, blk+1);
-          //for (size_t i = 0; i <= length; i++) Merkat trying above
-          //{
-          //atparser_putc(self->at, buf[i]);
-          //osDelay(100);
-          /* code */
-          //}
-          // ssLoggingPrint(ESsLoggingLevel_Debug, 0, "atparser_write(%d) returned %d", blk, temp);
-          if (atparser_recv(self->at, "OK"))
-          {
-            nbytes += blk;
-          }
-          else
-          {
-            success = false;
-          }
-        } else {
-          success = false;
-        }
+    // One block per turn on the channel, queued requests go in between
+    LOCK_SOCKET();
+    success = atparser_send(self->at, "AT+USOST=%d,\"%s\",%d,%d", socket,
+                            dest_addr->sin_addr, dest_addr->sin_port, blk) &&
+      modem_socket_write(self, buf, blk);
+    UNLOCK();
+    if (success) {
+      nbytes += blk;
+    }
     
     buf += blk;
     count -= blk;
   }
   
-  UNLOCK();
-  
     //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_sendto: %d \"%*.*s\"", nbytes, nbytes, nbytes, (char *) message);
     ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, message, nbytes, "[SOCK wr] ");
   return (nbytes > 0) ? nbytes : (-1);
@@ -571,8 +1000,6 @@ int16_t modem_socket_send(modem_t *self, int socket, const void *message, size_t
   
   /* @TODO: check if socket is open */
   
-  LOCK();
-  
   if (length > MAX_WRITE_SIZE) 
   {
     ssLoggingPrint(ESsLoggingLevel_Warning, 0, "WARNING: packet length %d is too big for one UDP packet (max %d), will be fragmented.", length, MAX_WRITE_SIZE);
@@ -585,281 +1012,122 @@ int16_t modem_socket_send(modem_t *self, int socket, const void *message, size_t
       blk = count;
     }
     
-    if (atparser_send(self->at, "AT+USOWR=%d,%d", socket, blk) &&
-        atparser_recv(self->at, "@")) 
-    {
-      osDelay(100);
-      //int temp;
-      //temp = atparser_write(self->at, buf, blk);
-      for (size_t i = 0; i <= length; i++) 
-      {
-        atparser_putc(self->at, buf[i]);
-        //osDelay(100);
-        /* code */
-        // ssLoggingPrint(ESsLoggingLevel_Debug, 0, "atparser_write(%d) returned %d", blk, temp);
-        if (atparser_recv(self->at, "OK"))
-        {
-          nbytes += blk;
-        }
-        else
-        {
-          success = false;
-        }
-      }
-    }
-    else 
+    // One block per turn on the channel, queued requests go in between
+    LOCK_SOCKET();
+    success = atparser_send(self->at, "AT+USOWR=%d,%d", socket, blk) &&
+      modem_socket_write(self, buf, blk);
+    UNLOCK();
+    if (success)
     {
-      success = false;
+      nbytes += blk;
     }
     
     buf += blk;
     count -= blk;
   }
   
-  UNLOCK();
-  
   ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_sendto: %d \"%*.*s\"", nbytes, nbytes, nbytes, (char *) message);
   ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, message, nbytes, "[SOCK wr] ");
   return (nbytes > 0) ? nbytes : (-1);
 }
 
+// Stream one block of payload as soon as the '@' prompt of AT+USOST/AT+USOWR
+// is there, then wait for the OK that accepts the whole block
+static bool modem_socket_write(modem_t *self, const char *buf, size_t blk)
+{
+  if (!atparser_recv_pattern(self->at, &prompt_pattern))
+  {
+    return false;
+  }
+  // The only pause left is the one the module documents
+  if (self->dev_info.dev == DEV_SARA_U2)
+  {
+    vTaskDelay(pdMS_TO_TICKS(MODEM_PROMPT_GUARD_SARA_U2));
+  }
+  if (atparser_write(self->at, buf, blk) != (int)blk)
+  {
+    return false;
+  }
+  return atparser_recv_pattern(self->at, &ok_pattern);
+}
+
 int16_t modem_socket_recv(modem_t *self, int socket, void *buffer, size_t length)
 {
-  
-  bool success = true;
-  char *buf = (char *)buffer;
-  int32_t read_blk;
+  SockCtrl *sock = &self->sockets[socket];
+  FifoHandle_t rx;
   int32_t count = 0;
-  unsigned int usord_sz;
-  int read_sz;
-  int at_timeout;
-  TickType_t xTicksToWait = RECV_TASK_TIMEOUT;
-  TimeOut_t xTimeOut;
-  
   
   ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recv(%d, %p, %d)",
                  socket, buffer, length);
   
-  //timer.start();
-  LOCK();
-  vTaskSetTimeOutState(&xTimeOut);
+  rx = modem_socket_reader_enter(sock);
+  if (rx == NULL)
+  {
+    return 0;
+  }
   
-  while (success && (length > 0)) 
+  // The reader task fills the ring as soon as the modem announces data
+  if (fifo_wait(rx, 1, FIFO_NO_DELIMITER, SOCKET_TIMEOUT) == 0)
   {
-    at_timeout = self->at_timeout;
-    atparser_set_timeout(self->at, 1000);
-    
-    
-    read_blk = MAX_READ_SIZE;
-    if (read_blk > length) {
-      read_blk = length;
-    }
-    if (self->sockets[socket].pending > 0) 
-    {
-      ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Socket %d: has %d byte(s) pending",
-                     socket, self->sockets[socket].pending);
-      
-      if (atparser_send(self->at, "AT+USORD=%d,%d", socket, read_blk) &&
-          atparser_recv(self->at, "+USORD: %*d,%d,\"", &usord_sz)) 
-      {
-        // Must use what +USORD returns here as it may be less or more than we asked for
-        if (usord_sz > self->sockets[socket].pending) 
-        {
-          self->sockets[socket].pending = 0;
-        }
-        else 
-        {
-          self->sockets[socket].pending -= usord_sz;
-        }
-        // Note: insert no debug between _at->recv() and _at->read(), no time...
-        if (usord_sz > length) 
-        {
-          usord_sz = length;
-        }
-        while((usord_sz>0) && success)
-        {
-          read_sz = atparser_read(self->at, buf, usord_sz);
-          if (read_sz > 0)
-          {
-            ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, buf, read_sz, "[SOCK rd] (%d)-> ", usord_sz);
-            count += read_sz;
-            buf += read_sz;
-            length -= read_sz;
-            if ((usord_sz < read_blk) || (usord_sz == MAX_READ_SIZE))
-            {
-              length = 0; // If we've received less than we asked for, or
-              // the max size, then a whole UDP packet has arrived and
-              // this means DONE.
-            }
-            usord_sz -= read_sz;
-          }
-          else
-          {
-            // read() should not fail
-            success = false;
-          }
-          ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Socket %d: now has only %d byte(s) pending",
-                         socket, self->sockets[socket].pending);
-        }
-        // Wait for the "OK" before continuing
-        atparser_recv(self->at, "OK");
-      }
-      else
-      {
-        // Should never fail to do _at->send()/_at->recv()
-        success = false;
-      }
-      //_at->debug_on(_debug_trace_on);
-    }
-    else if (xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) != pdFALSE)
+    modem_socket_reader_exit(sock);
+    ssLoggingPrint(ESsLoggingLevel_Debug, 0, "SOCKET RECV TIMEOUTED");
+    return 0;
+  }
+  
+  if (sock->protocol == IPPROTO_UDP)
+  {
+    count = modem_socket_read_datagram(rx, buffer, length, NULL);
+  }
+  else
+  {
+    if (length > fifo_length(rx))
     {
-      //Wait for URCs
-      atparser_recv(self->at, UNNATURAL_STRING);
-      ssLoggingPrint(ESsLoggingLevel_Debug, 0, "SOCKET RECV TIMEOUTED");
-      break;
+      length = fifo_length(rx);
     }
-    
-    atparser_set_timeout(self->at, at_timeout);
+    count = fifo_read(rx, buffer, length, 0);
   }
-  UNLOCK();
-  ulTaskNotifyTake( pdTRUE, xTicksToWait );
-  //timer.stop();
+  modem_socket_reader_exit(sock);
+  modem_socket_prefetch_kick(self, socket);
   
-  ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recv: %d \"%*.*s\"", count, count, count, buf - count);
+  ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recv: %d \"%*.*s\"", count, count, count, (char *)buffer);
   
   return count;
 }
 
-
 int16_t modem_socket_recvfrom(modem_t *self,
                               int socket,
                               void *buffer,
                               size_t length,
                               struct SocketAddress_in *restrict address)
 {
-  
-  bool success = true;
-  char *buf = (char *)buffer;
-  int32_t read_blk;
+  SockCtrl *sock = &self->sockets[socket];
+  FifoHandle_t rx;
   int32_t count = 0;
-  char ipAddress[SOCK_IP_SIZE];
-  int port;
-  unsigned int usorf_sz;
-  int read_sz;
-  int at_timeout;
-  TickType_t xTicksToWait = RECV_TASK_TIMEOUT;
-  TimeOut_t xTimeOut;
-  
-    //ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recvfrom(%d, %p, %d)",
-    //               socket, buffer, length);
-  
-  //timer.start();
-  LOCK();
-  vTaskSetTimeOutState(&xTimeOut);
   
+  ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recvfrom(%d, %p, %d)",
+                 socket, buffer, length);
   
-  while (success && (length > 0)) 
+  if (sock->protocol != IPPROTO_UDP)
   {
-    at_timeout = self->at_timeout;
-    atparser_set_timeout(self->at, 1000);
-    
-    read_blk = MAX_READ_SIZE;
-    if (read_blk > length) 
-    {
-      read_blk = length;
-    }
-    if (self->sockets[socket].pending > 0) 
-    {
-      ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Socket %d: has %d byte(s) pending",
-                     socket, self->sockets[socket].pending);
-      memset (ipAddress, 0, sizeof (ipAddress)); // Ensure terminator
-      
-      
-      // Note: the maximum length of UDP packet we can receive comes from
-      // fitting all of the following into one buffer:
-      //
-      // +USORF: xx,"max.len.ip.address.ipv4.or.ipv6",yyyyy,wwww,"the_data"\r\n
-      //
-      // where xx is the handle, max.len.ip.address.ipv4.or.ipv6 is NSAPI_IP_SIZE,
-      // yyyyy is the port number (max 65536), wwww is the length of the data and
-      // the_data is binary data. I make that 29 + 48 + len(the_data),
-      // so the overhead is 77 bytes.
-      
-      //_at->debug_on(false); // ABSOLUTELY no time for debug here if you want to
-      // be able to read packets of any size without
-      // losing characters in UARTSerial
-      if (atparser_send(self->at, "AT+USORF=%d,%d", socket, read_blk) &&
-          atparser_recv(self->at, "+USORF: %*d,\"%" u_stringify(SOCK_IP_SIZE) "[^\"]\",%d,%d,\"",
-                        ipAddress, &port, &usorf_sz)) 
-      {
-        // Must use what +USORF returns here as it may be less or more than we asked for
-        if (usorf_sz > self->sockets[socket].pending) 
-        {
-          self->sockets[socket].pending = 0;
-        }
-        else
-        {
-          self->sockets[socket].pending -= usorf_sz;
-        }
-        // Note: insert no debug between _at->recv() and _at->read(), no time...
-        if (usorf_sz > length) 
-        {
-          usorf_sz = length;
-        }
-        while((usorf_sz>0) && success)
-        {
-          read_sz = atparser_read(self->at, buf, usorf_sz);
-          if (read_sz > 0) 
-          {
-            //address->sin_addr = pvPortMalloc(sizeof(ipAddress));
-            strcpy(address->sin_addr, ipAddress);
-            address->sin_port = port;
-            ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, buf, read_sz, "[SOCK rd] %s:%d (%d)-> ", ipAddress, port, usorf_sz);
-            count += read_sz;
-            buf += read_sz;
-            length -= read_sz;
-            if ((usorf_sz < read_blk) || (usorf_sz == MAX_READ_SIZE))
-            {
-              length = 0; // If we've received less than we asked for, or
-              // the max size, then a whole UDP packet has arrived and
-              // this means DONE.
-            }
-            usorf_sz -= read_sz;
-          }
-          else
-          {
-            // read() should not fail
-            success = false;
-          }
-          ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Socket %d: now has only %d byte(s) pending",
-                         socket, self->sockets[socket].pending);
-        }
-        // Wait for the "OK" before continuing
-        atparser_recv(self->at, "OK");
-      }
-      else
-      {
-        // Should never fail to do _at->send()/_at->recv()
-        success = false;
-      }
-      //_at->debug_on(_debug_trace_on);
-    }
-    else if (xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) != pdFALSE)
-    {
-      //Wait for URCs
-      atparser_recv(self->at, UNNATURAL_STRING);
-      break;
-    }
-    
-    atparser_set_timeout(self->at, at_timeout);
-    
+    // A stream has no datagram sources to report
+    return modem_socket_recv(self, socket, buffer, length);
   }
   
-  //timer.stop();
-  UNLOCK();
-  ulTaskNotifyTake(pdTRUE, xTicksToWait); // Merkat experimenting with this
+  rx = modem_socket_reader_enter(sock);
+  if (rx == NULL)
+  {
+    return 0;
+  }
   
-  // ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_recvfrom: %d \"%*.*s\"", count, count, count, buf - count);
+  if (fifo_wait(rx, 1, FIFO_NO_DELIMITER, SOCKET_TIMEOUT) > 0)
+  {
+    count = modem_socket_read_datagram(rx, buffer, length, address);
+  }
+  modem_socket_reader_exit(sock);
+  if (count > 0)
+  {
+    modem_socket_prefetch_kick(self, socket);
+  }
   
   return count;
 }
@@ -870,7 +1138,7 @@ int16_t modem_socket_connect(modem_t *self, int socket, const struct SocketAddre
   
   ssLoggingPrint(ESsLoggingLevel_Debug, 0, "socket_connect(%d, %s:%d)",
                  socket, address->sin_addr, address->sin_port);
-  LOCK();
+  LOCK_SOCKET();
   if (atparser_send(self->at, "AT+USOCO=%d,\"%s\",%d", socket, address->sin_addr, address->sin_port) &&
       atparser_recv(self->at, "OK"))
   {
@@ -900,8 +1168,13 @@ bool power_up(modem_t *self)
   }
   else
   {
-    success = atparser_send(self->at, "ATE0") && atparser_recv(self->at, "OK") &&
-      atparser_send(self->at, "AT+CMEE=2") && atparser_recv(self->at, "OK");
+    static const atparser_step setup[] =
+    {
+      { "ATE0",      NULL, NULL, 0, 2, 100, ATPARSER_STEP_CONCAT },
+      { "AT+CMEE=2", NULL, NULL, 0, 2, 100, 0 },
+    };
+    
+    success = atparser_run_script(self->at, setup, COUNT_OF(setup)) == COUNT_OF(setup);
     if(!success)
     {
       // ssLoggingPrint(ESsLoggingLevel_Debug, 0, "Preliminary modem setup failed.\n");
@@ -911,6 +1184,63 @@ bool power_up(modem_t *self)
   return success;
 }
 
+// Raise the link speed with AT+IPR. Every new rate is verified with AT; when
+// that fails the modem is reset to the default rate and the next, slower
+// rate is tried.
+// Returns false only if the link is lost altogether.
+bool set_link_speed(modem_t *self)
+{
+  bool success = false;
+  
+  for(int i=0; !success && i<sizeof(link_speeds)/sizeof(link_speeds[0]); i++)
+  {
+    if(atparser_send(self->at, "AT+IPR=%lu", link_speeds[i]) && atparser_recv(self->at, "OK"))
+    {
+      success = verify_link_speed(self, link_speeds[i]);
+      if(!success)
+      {
+        // The link at the new rate does not work, so the modem cannot be
+        // asked to go back over it. IPR is not stored, a reset brings the
+        // modem back at the default rate; the next, slower rate is tried there.
+        ssLoggingPrint(ESsLoggingLevel_Warning, 0, "Modem link speed %lu failed, resetting.", link_speeds[i]);
+        reset(self);
+        ssUartSetBaudrate(self->fd, MODEM_UART_BAUDRATE);
+        self->baudrate = MODEM_UART_BAUDRATE;
+        if(!power_up(self))
+        {
+          ssLoggingPrint(ESsLoggingLevel_Error, 0, "Modem lost while changing link speed.");
+          return false;
+        }
+      }
+    }
+  }
+  
+  ssLoggingPrint(ESsLoggingLevel_Info, 0, "Modem link speed %lu.", self->baudrate);
+  
+  return true;
+}
+
+// Switch the local uart to baudrate and check that the modem answers there.
+bool verify_link_speed(modem_t *self, uint32_t baudrate)
+{
+  bool success = false;
+  
+  if(ssUartSetBaudrate(self->fd, baudrate) != DDAL_UART_OK)
+  {
+    return false;
+  }
+  self->baudrate = baudrate;
+  osDelay(MODEM_IPR_SETTLE_TIME);
+  
+  atparser_flush(self->at);
+  for(int i=0; !success && i<3; i++)
+  {
+    success = atparser_command(self->at, MODEM_IPR_TIMEOUT, "AT") && atparser_recv(self->at, "OK");
+  }
+  
+  return success;
+}
+
 bool reset(modem_t *self)
 {
   bool success = true;;
@@ -976,13 +1306,21 @@ bool init_sim_card(modem_t *self)
 
 
 // Get the device ID.
+// Read the model and the IMSI, IMEI and MEID in one script.
 bool set_device_identity(modem_t *self)
 {
   char buf[20];
   bool success;
+  const atparser_step identity[] =
+  {
+    { "ATI",     "%19[^\n]\n", buf,                  0, 1, 100, 0 },
+    { "AT+CIMI", "%15[^\n]\n", self->dev_info.imsi, 0, 1, 100, 0 },
+    { "AT+CGSN", "%15[^\n]\n", self->dev_info.imei, 0, 1, 100, 0 },
+    { "AT+GSN",  "%18[^\n]\n", self->dev_info.meid, 0, 1, 100, 0 },
+  };
   LOCK();
   
-  success = atparser_send(self->at, "ATI") && atparser_recv(self->at, "%19[^\n]\nOK\n", buf);
+  success = atparser_run_script(self->at, identity, COUNT_OF(identity)) == COUNT_OF(identity);
   
   if (success)
   {
@@ -1028,32 +1366,40 @@ bool activate_profile(modem_t *self,
                       const char* username,
                       const char* password)
 {
-  bool activated = false;
-  bool success = false;
-  int at_timeout = self->at_timeout;
-  //SocketAddress_in address;
+  char apn_cmd[MODEM_UPSD_CMD_SIZE];
+  char username_cmd[MODEM_UPSD_CMD_SIZE];
+  char password_cmd[MODEM_UPSD_CMD_SIZE];
+  atparser_step steps[5];
+  int count = 0;
   
-  // Set up the APN
-  if (apn) {
-    success = atparser_send(self->at, "AT+UPSD=" PROFILE ",1,\"%s\"", apn) && atparser_recv(self->at, "OK");
+  if (!apn) {
+    return false;
   }
-  if (success && username) {
-    success = atparser_send(self->at, "AT+UPSD=" PROFILE ",2,\"%s\"", username) && atparser_recv(self->at, "OK");
+  
+  // Profile parameters go out on one command line, then activation waits
+  // 30 seconds for the connection to be made. A parameter that does not
+  // fit is refused rather than sent cut short.
+  if (snprintf(apn_cmd, sizeof(apn_cmd), "AT+UPSD=" PROFILE ",1,\"%s\"", apn) >= (int)sizeof(apn_cmd)) {
+    return false;
   }
-  if (success && password) {
-    success = atparser_send(self->at, "AT+UPSD=" PROFILE ",3,\"%s\"", password) && atparser_recv(self->at, "OK");
+  steps[count++] = (atparser_step){ apn_cmd, NULL, NULL, 0, 0, 0, ATPARSER_STEP_CONCAT };
+  if (username) {
+    if (snprintf(username_cmd, sizeof(username_cmd), "AT+UPSD=" PROFILE ",2,\"%s\"", username) >= (int)sizeof(username_cmd)) {
+      return false;
+    }
+    steps[count++] = (atparser_step){ username_cmd, NULL, NULL, 0, 0, 0, ATPARSER_STEP_CONCAT };
   }
-  
-  if (success) {
-    // Set up dynamic IP address assignment.
-    success = atparser_send(self->at, "AT+UPSD=" PROFILE ",7,\"0.0.0.0\"") && atparser_recv(self->at, "OK");
-    // Activate, waiting 30 seconds for the connection to be made
-    atparser_set_timeout(self->at, 30000);
-    activated = atparser_send(self->at, "AT+UPSDA=" PROFILE ",3") && atparser_recv(self->at, "OK");
-    atparser_set_timeout(self->at, at_timeout);
+  if (password) {
+    if (snprintf(password_cmd, sizeof(password_cmd), "AT+UPSD=" PROFILE ",3,\"%s\"", password) >= (int)sizeof(password_cmd)) {
+      return false;
+    }
+    steps[count++] = (atparser_step){ password_cmd, NULL, NULL, 0, 0, 0, ATPARSER_STEP_CONCAT };
   }
+  // Set up dynamic IP address assignment.
+  steps[count++] = (atparser_step){ "AT+UPSD=" PROFILE ",7,\"0.0.0.0\"", NULL, NULL, 0, 0, 0, 0 };
+  steps[count++] = (atparser_step){ "AT+UPSDA=" PROFILE ",3", NULL, NULL, 30000, 0, 0, 0 };
   
-  return activated;
+  return atparser_run_script(self->at, steps, count) == count;
 }
 
 
@@ -1182,6 +1528,100 @@ void set_nwk_reg_status_csd(modem_t *self, int status)
   self->dev_info.reg_status_csd = (NetworkRegistrationStatusCsd)status;
 }
 
+void set_nwk_reg_status_psd(modem_t *self, int status)
+{
+  self->dev_info.reg_status_psd = (NetworkRegistrationStatusPsd)status;
+}
+
+void set_nwk_reg_status_eps(modem_t *self, int status)
+{
+  self->dev_info.reg_status_eps = (NetworkRegistrationStatusEps)status;
+}
+
+// Split a registration line into status and access technology. URCs carry
+// "<stat>[,<lac>,<ci>[,<AcT>...]]", answers to a query put "<n>," in front.
+// act is left alone when the line has no access technology.
+static bool modem_reg_parse(char *line, int *status, int *act)
+{
+  char *field[6];
+  int count = 0;
+  char *next;
+  
+  line += strspn(line, ": ");
+  for (next = line; (next != NULL) && (count < COUNT_OF(field)); count++)
+  {
+    field[count] = next;
+    next = strchr(next, ',');
+    if (next != NULL)
+    {
+      *next++ = 0;
+    }
+  }
+  
+  // Location fields are quoted, a bare second field is the status of a query answer
+  if ((count >= 2) && (field[1][0] != '"'))
+  {
+    memmove(&field[0], &field[1], (count - 1) * sizeof(field[0]));
+    count--;
+  }
+  
+  if (!isdigit((unsigned char)field[0][0]))
+  {
+    return false;
+  }
+  *status = atoi(field[0]);
+  if ((count >= 4) && isdigit((unsigned char)field[3][0]))
+  {
+    *act = atoi(field[3]);
+  }
+  return true;
+}
+
+// Publish the registration state to the event group and report changes
+static void modem_reg_publish(modem_t *self)
+{
+  EventBits_t bits = 0;
+  EventBits_t old;
+  
+  if (is_registered_csd(self))
+  {
+    bits |= MODEM_REG_CSD;
+  }
+  if (is_registered_psd(self))
+  {
+    bits |= MODEM_REG_PSD;
+  }
+  if (is_registered_eps(self))
+  {
+    bits |= MODEM_REG_EPS;
+  }
+  if ((self->dev_info.reg_status_csd == CSD_REGISTERED_ROAMING) ||
+      (self->dev_info.reg_status_psd == PSD_REGISTERED_ROAMING) ||
+      (self->dev_info.reg_status_eps == EPS_REGISTERED_ROAMING))
+  {
+    bits |= MODEM_REG_ROAMING;
+  }
+  
+  old = xEventGroupGetBits(reg_events) & MODEM_REG_ALL;
+  if (bits == old)
+  {
+    return;
+  }
+  xEventGroupClearBits(reg_events, old & ~bits);
+  xEventGroupSetBits(reg_events, bits);
+  
+  if ((bits & MODEM_REG_ANY) == 0)
+  {
+    ssLoggingPrint(ESsLoggingLevel_Info, 0, "Network registration lost");
+  }
+  else if (((old & MODEM_REG_ANY) == 0) || ((bits ^ old) & MODEM_REG_ROAMING))
+  {
+    ssLoggingPrint(ESsLoggingLevel_Info, 0, "Registered%s on %s",
+                   (bits & MODEM_REG_ROAMING) ? " roaming" : "",
+                   (self->dev_info.rat < RAN_TYPE_LAST) ? ran_type_name_table[self->dev_info.rat] : "unknown RAT");
+  }
+}
+
 // Callback for CME ERROR and CMS ERROR.
 void CMX_ERROR_URC(void *param)
 {
@@ -1194,29 +1634,331 @@ void CMX_ERROR_URC(void *param)
   parser_abort_cb(self);
 }
 
-// Callback for circuit switched registration URC.
+// Callbacks for the registration URCs and query answers, one per domain.
+// Note: not calling atparser_recv() from here as we're
+// already in an atparser_recv()
 void CREG_URC(void *param)
 {
   modem_t *self = (modem_t *)param;
-  char buf[10];
+  char buf[MODEM_REG_URC_SIZE];
   int status;
+  int act = -1;
   
-  // If this is the URC it will be a single
-  // digit followed by \n.  If it is the
-  // answer to a CREG query, it will be
-  // a ": %d,%d\n" where the second digit
-  // indicates the status
-  // Note: not calling atparser_recv() from here as we're
-  // already in an atparser_recv()
-  if (read_at_to_char(self, buf, sizeof (buf), '\n') > 0) {
-    if (sscanf(buf, ": %*d,%d", &status) == 1) {
-      set_nwk_reg_status_csd(self, status);
-    } else if (sscanf(buf, ": %d", &status) == 1) {
-      set_nwk_reg_status_csd(self, status);
+  if ((read_at_to_char(self, buf, sizeof (buf), '\n') > 0) && modem_reg_parse(buf, &status, &act)) {
+    set_nwk_reg_status_csd(self, status);
+    if (act >= 0) {
+      set_rat(self, act);
     }
+    modem_reg_publish(self);
   }
 }
 
+void CGREG_URC(void *param)
+{
+  modem_t *self = (modem_t *)param;
+  char buf[MODEM_REG_URC_SIZE];
+  int status;
+  int act = -1;
+  
+  if ((read_at_to_char(self, buf, sizeof (buf), '\n') > 0) && modem_reg_parse(buf, &status, &act)) {
+    set_nwk_reg_status_psd(self, status);
+    if (act >= 0) {
+      set_rat(self, act);
+    }
+    modem_reg_publish(self);
+  }
+}
+
+void CEREG_URC(void *param)
+{
+  modem_t *self = (modem_t *)param;
+  char buf[MODEM_REG_URC_SIZE];
+  int status;
+  int act = -1;
+  
+  if ((read_at_to_char(self, buf, sizeof (buf), '\n') > 0) && modem_reg_parse(buf, &status, &act)) {
+    set_nwk_reg_status_eps(self, status);
+    if (act >= 0) {
+      set_rat(self, act);
+    }
+    modem_reg_publish(self);
+  }
+}
+
+// Make the reader task look at the sockets again: data was announced or
+// the application made room in a ring. If a command holds the channel the
+// reader task prefetches once it gets the channel back.
+static void modem_socket_prefetch_kick(modem_t *self, int socket)
+{
+  if ((urc_task != NULL) && (self->sockets[socket].pending > 0))
+  {
+    // Socket data does not wait behind queued control requests
+    taskENTER_CRITICAL();
+    if ((urc_waiter.prio < MODEM_PRIO_SOCKET) && modem_channel_dequeue(&urc_waiter))
+    {
+      urc_waiter.prio = MODEM_PRIO_SOCKET;
+      modem_channel_enqueue(&urc_waiter);
+      modem_channel_inherit(&urc_waiter);
+    }
+    taskEXIT_CRITICAL();
+    ssUartWaitCancel(urc_fd);
+  }
+}
+
+// True if a socket has announced data and room in its ring to take some
+static bool modem_socket_wanted(modem_t *self)
+{
+  for (int socket = 0; socket < SOCKET_COUNT; socket++)
+  {
+    if (modem_socket_block(&self->sockets[socket]) > 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Move data announced by +UUSORD/+UUSORF into the socket rings, one block
+// per socket and round so that a command waiting for the channel is not
+// held up. Returns true if anything was read.
+static bool modem_socket_prefetch(modem_t *self)
+{
+  bool progress = false;
+  
+  for (int socket = 0; (socket < SOCKET_COUNT) && (channel_waiters == 0); socket++)
+  {
+    if (modem_socket_fill(self, socket))
+    {
+      progress = true;
+    }
+  }
+  
+  return progress;
+}
+
+// Bytes the next read of a socket may ask for, 0 if there is nothing to
+// read or no room for it. A stream takes what fits; a datagram is only
+// read once the whole of it fits behind its header, as AT+USORF drops
+// whatever part of a datagram was not asked for.
+static uint32_t modem_socket_block(SockCtrl *sock)
+{
+  uint32_t blk = sock->pending;
+  uint32_t room;
+  
+  if ((sock->rx == NULL) || (blk == 0))
+  {
+    return 0;
+  }
+  if (blk > MAX_READ_SIZE)
+  {
+    blk = MAX_READ_SIZE;
+  }
+  room = fifo_free(sock->rx);
+  if (sock->protocol == IPPROTO_UDP)
+  {
+    return (room >= blk + sizeof(modem_datagram)) ? blk : 0;
+  }
+  return (blk > room) ? room : blk;
+}
+
+// Pin the ring of a socket for modem_socket_recv/recvfrom, NULL if the
+// socket has none
+static FifoHandle_t modem_socket_reader_enter(SockCtrl *sock)
+{
+  FifoHandle_t rx;
+  
+  taskENTER_CRITICAL();
+  rx = sock->rx;
+  if (rx != NULL)
+  {
+    sock->readers++;
+  }
+  taskEXIT_CRITICAL();
+  return rx;
+}
+
+static void modem_socket_reader_exit(SockCtrl *sock)
+{
+  taskENTER_CRITICAL();
+  sock->readers--;
+  taskEXIT_CRITICAL();
+}
+
+// Take the ring away from a socket and free it once the readers still
+// inside it have left. Called with the channel held, so the reader task
+// is not filling it.
+static void modem_socket_release_rx(SockCtrl *sock)
+{
+  FifoHandle_t rx;
+  
+  taskENTER_CRITICAL();
+  rx = sock->rx;
+  sock->rx = NULL;
+  taskEXIT_CRITICAL();
+  if (rx == NULL)
+  {
+    return;
+  }
+  // A reader waiting for data gives up now, one inside fifo_read within
+  // SOCKET_TIMEOUT
+  fifo_wait_cancel(rx);
+  while (sock->readers > 0)
+  {
+    vTaskDelay(1);
+  }
+  fifo_destroy(rx);
+}
+
+// Read one block of a socket into its ring, straight from the AT channel.
+// Called by the reader task with the channel held.
+static bool modem_socket_fill(modem_t *self, int socket)
+{
+  SockCtrl *sock = &self->sockets[socket];
+  bool udp = (sock->protocol == IPPROTO_UDP);
+  uint32_t blk = modem_socket_block(sock);
+  modem_datagram dgram;
+  unsigned int size = 0;
+  uint32_t want;
+  uint32_t stored = 0;
+  int port = 0;
+  bool success;
+  
+  if (blk == 0)
+  {
+    // Ring full, modem_socket_recv kicks us once there is room
+    return false;
+  }
+  
+  memset(&dgram, 0, sizeof(dgram));
+  if (udp)
+  {
+    success = atparser_command(self->at, MODEM_SOCKET_READ_TIMEOUT, "AT+USORF=%d,%d", socket, blk) &&
+      atparser_recv_pattern(self->at, &usorf_pattern, dgram.addr, &port, &size);
+  }
+  else
+  {
+    success = atparser_command(self->at, MODEM_SOCKET_READ_TIMEOUT, "AT+USORD=%d,%d", socket, blk) &&
+      atparser_recv_pattern(self->at, &usord_pattern, &size);
+  }
+  if (!success)
+  {
+    // Wait for the next +UUSORD/+UUSORF instead of retrying
+    sock->pending = 0;
+    return false;
+  }
+  
+  // What +USORD/+USORF returns may differ from what was asked for
+  sock->pending = (size > sock->pending) ? 0 : sock->pending - size;
+  want = (size > blk) ? blk : size;
+  
+  if (udp)
+  {
+    dgram.len = want;
+    dgram.port = port;
+    fifo_write(sock->rx, (const uint8_t *)&dgram, sizeof(dgram), 0);
+  }
+  
+  // Payload goes straight into the ring, anything beyond the room asked for
+  // is dropped
+  while (size > 0)
+  {
+    uint8_t scratch[16];
+    uint8_t *space = scratch;
+    uint32_t n = 0;
+    
+    if (stored < want)
+    {
+      n = fifo_reserve(sock->rx, &space, 0);
+      if (n > want - stored)
+      {
+        n = want - stored;
+      }
+    }
+    if (n == 0)
+    {
+      space = scratch;
+      n = sizeof(scratch);
+    }
+    if (n > size)
+    {
+      n = size;
+    }
+    n = atparser_read_counted(self->at, (char *)space, n);
+    if (n == 0)
+    {
+      break;
+    }
+    if (space != scratch)
+    {
+      fifo_commit(sock->rx, n);
+      stored += n;
+    }
+    size -= n;
+  }
+  
+  // A datagram cut short is padded to keep the ring framing
+  while (udp && (stored < want))
+  {
+    uint8_t zero = 0;
+    if (fifo_write(sock->rx, &zero, 1, 0) == 0)
+    {
+      break;
+    }
+    stored++;
+  }
+  
+  // Wait for the "OK" before continuing
+  atparser_recv_pattern(self->at, &ok_pattern);
+  return true;
+}
+
+// Take the next datagram out of a UDP socket ring; what does not fit in
+// buffer is dropped, as with any datagram socket
+static int32_t modem_socket_read_datagram(FifoHandle_t rx, void *buffer, size_t length,
+                                          struct SocketAddress_in *address)
+{
+  modem_datagram dgram;
+  uint32_t count;
+  uint32_t left;
+  
+  // The reader task writes header and payload back to back
+  if (fifo_read(rx, (uint8_t *)&dgram, sizeof(dgram), SOCKET_TIMEOUT) != sizeof(dgram))
+  {
+    return 0;
+  }
+  count = (dgram.len < length) ? dgram.len : length;
+  count = fifo_read(rx, buffer, count, SOCKET_TIMEOUT);
+  
+  left = dgram.len - count;
+  while (left > 0)
+  {
+    const uint8_t *data;
+    uint32_t n = fifo_peek_contiguous(rx, &data, SOCKET_TIMEOUT);
+    
+    if (n == 0)
+    {
+      break;
+    }
+    if (n > left)
+    {
+      n = left;
+    }
+    fifo_consume(rx, n);
+    left -= n;
+  }
+  
+  if (address != NULL)
+  {
+    strncpy(address->sin_addr, dgram.addr, sizeof(address->sin_addr) - 1);
+    address->sin_addr[sizeof(address->sin_addr) - 1] = 0;
+    address->sin_port = dgram.port;
+  }
+  ssLoggingPrintRawStr(ESsLoggingLevel_Debug, 0, buffer, count, "[SOCK rd] %s:%d (%d)-> ",
+                       dgram.addr, dgram.port, dgram.len);
+  
+  return count;
+}
+
 // Callback for Socket Read URC.
 void UUSORD_URC(void *param)
 {
@@ -1232,6 +1974,7 @@ void UUSORD_URC(void *param)
     if (sscanf(buf, ": %d,%d", &socket, &nbytes) == 2) {
       if (socket < SOCKET_COUNT) {
         self->sockets[socket].pending = nbytes;
+        modem_socket_prefetch_kick(self, socket);
         // No debug prints here as they can affect timing
         // and cause data loss in UARTSerial
         //if (socket->callback != NULL) {
@@ -1257,6 +2000,7 @@ void UUSORF_URC(void *param)
     if (sscanf(buf, ": %d,%d", &socket, &nbytes) == 2) {
       if (socket < SOCKET_COUNT) {
         self->sockets[socket].pending = nbytes;
+        modem_socket_prefetch_kick(self, socket);
         // No debug prints here as they can affect timing
         // and cause data loss in UARTSerial
         //if (socket->callback != NULL) {
@@ -1287,6 +2031,192 @@ void UUSOCL_URC(void *param)
 
 
 
+static void modem_urc_start(modem_t *self)
+{
+  BaseType_t ret;
+  
+  if (urc_task == NULL)
+  {
+    urc_fd = self->fd;
+    ret = xTaskCreate(modem_urc_task,
+                      MODEM_URC_TASK_NAME,
+                      MODEM_URC_TASK_STACK_SIZE, /* Stack depth in words. */
+                      self,
+                      MODEM_URC_TASK_PRIORITY,
+                      &urc_task);
+    configASSERT(ret == pdPASS);
+  }
+}
+
+// Owns the AT channel whenever no command holds it. Lines arriving then are
+// unsolicited, so URCs are dispatched to their handlers right away and
+// anything else is dropped. A command that needs the channel cancels the
+// wait through LOCK(); its own atparser_recv then sees the solicited
+// response and any URC interleaved with it. The task queues for the
+// channel in the lowest class, raised to the socket class while socket data
+// waits to be fetched.
+static void modem_urc_task(void *param)
+{
+  modem_t *self = (modem_t *)param;
+  uint8_t prio = MODEM_PRIO_IDLE;
+  
+  for (;;)
+  {
+    modem_channel_take(&urc_waiter, prio);
+    while (channel_waiters == 0)
+    {
+      // Drain announced socket data while nobody else needs the channel
+      while ((channel_waiters == 0) && modem_socket_prefetch(self))
+      {
+      }
+      if (channel_waiters != 0)
+      {
+        break;
+      }
+      // Sleep until a whole line is buffered, a command wants the channel
+      // or a socket ring has room for pending data again
+      if ((ssUartWait(self->fd, MODEM_UART_BUFFER_SIZE, '\n', osWaitForever) > 0) &&
+          (channel_waiters == 0))
+      {
+        atparser_set_timeout(self->at, MODEM_URC_LINE_TIMEOUT);
+        while ((channel_waiters == 0) && atparser_process_oob(self->at))
+        {
+        }
+        atparser_set_timeout(self->at, self->at_timeout);
+      }
+    }
+    // Look at the rings while socket open and close are held off
+    prio = modem_socket_wanted(self) ? MODEM_PRIO_SOCKET : MODEM_PRIO_IDLE;
+    UNLOCK();
+  }
+}
+
+static void modem_dns_done(void *ctx, bool success, const char *response)
+{
+  modem_dns_request *request = (modem_dns_request *)ctx;
+  char ipAddress[SOCK_IP_SIZE + 1];
+  struct in_addr addr;
+  int32_t status = -1;
+  uint32_t address = 0;
+  
+  if (success && atparser_pattern_parse(&udnsrn_pattern, response, ipAddress) &&
+      (inet_aton(ipAddress, &addr) != 0))
+  {
+    address = addr.s_addr;
+    status = 0;
+  }
+  
+  modem_dns_cache_store(request->host, status, address);
+  if (request->callback)
+  {
+    request->callback(request->ctx, status, address);
+  }
+  vPortFree(request);
+}
+
+// Find host in the cache. A hit close to expiry sets refresh for the first
+// caller only, so one background lookup renews the entry.
+static bool modem_dns_cache_lookup(const char *host, int32_t *status, uint32_t *address,
+                                   bool *refresh)
+{
+  TickType_t now = xTaskGetTickCount();
+  bool found = false;
+  
+  *refresh = false;
+  taskENTER_CRITICAL();
+  for (int i = 0; i < MODEM_DNS_CACHE_SIZE; i++)
+  {
+    modem_dns_entry *entry = &dns_cache[i];
+    
+    if ((entry->host[0] == 0) || (strcmp(entry->host, host) != 0))
+    {
+      continue;
+    }
+    if ((int32_t)(entry->expires - now) <= 0)
+    {
+      break;
+    }
+    
+    found = true;
+    *status = entry->status;
+    if (entry->status == 0)
+    {
+      *address = entry->address;
+      if ((MODEM_DNS_REFRESH_AHEAD > 0) && !entry->refreshing &&
+          ((int32_t)(entry->expires - now) < (int32_t)pdMS_TO_TICKS(MODEM_DNS_REFRESH_AHEAD)))
+      {
+        entry->refreshing = true;
+        *refresh = true;
+      }
+    }
+    break;
+  }
+  taskEXIT_CRITICAL();
+  
+  return found;
+}
+
+// Remember the outcome of a lookup, failures for a shorter time. The entry
+// of the same name is replaced, otherwise a free or the oldest one.
+static void modem_dns_cache_store(const char *host, int32_t status, uint32_t address)
+{
+  TickType_t now = xTaskGetTickCount();
+  modem_dns_entry *victim = &dns_cache[0];
+  
+  if ((host[0] == 0) || (strlen(host) >= MODEM_DNS_NAME_SIZE))
+  {
+    return;
+  }
+  
+  taskENTER_CRITICAL();
+  for (int i = 0; i < MODEM_DNS_CACHE_SIZE; i++)
+  {
+    modem_dns_entry *entry = &dns_cache[i];
+    
+    if ((entry->host[0] != 0) && (strcmp(entry->host, host) == 0))
+    {
+      victim = entry;
+      break;
+    }
+    if ((victim->host[0] != 0) &&
+        ((entry->host[0] == 0) || ((int32_t)(entry->expires - victim->expires) < 0)))
+    {
+      victim = entry;
+    }
+  }
+  
+  if ((status != 0) && (victim->host[0] != 0) && (victim->status == 0) &&
+      (strcmp(victim->host, host) == 0) && ((int32_t)(victim->expires - now) > 0))
+  {
+    // A failed refresh keeps the address that still works
+    victim->refreshing = false;
+  }
+  else
+  {
+    strcpy(victim->host, host);
+    victim->status = status;
+    victim->address = address;
+    victim->expires = now + pdMS_TO_TICKS((status == 0) ? MODEM_DNS_TTL : MODEM_DNS_NEGATIVE_TTL);
+    victim->refreshing = false;
+  }
+  taskEXIT_CRITICAL();
+}
+
+// A refresh that could not be queued leaves the entry to the next caller
+static void modem_dns_cache_refresh_failed(const char *host)
+{
+  taskENTER_CRITICAL();
+  for (int i = 0; i < MODEM_DNS_CACHE_SIZE; i++)
+  {
+    if ((dns_cache[i].host[0] != 0) && (strcmp(dns_cache[i].host, host) == 0))
+    {
+      dns_cache[i].refreshing = false;
+      break;
+    }
+  }
+  taskEXIT_CRITICAL();
+}
+
 void parser_abort_cb(void *param)
 {
   modem_t *self = param;
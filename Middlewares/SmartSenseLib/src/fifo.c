@@ -15,14 +15,26 @@
 #include <string.h>
 
 #include "FreeRTOS.h"
+#include "task.h"
 #include "cmsis_os.h"
-#include "semphr.h"     /* for uxSemaphoreGetCount() */
 
 #include "fifo.h"
 
 /*------------------------- MACRO DEFINITIONS --------------------------------*/
 
+/* orders buffer accesses against the index update that publishes them */
+#define FIFO_MEMORY_BARRIER()   __sync_synchronize()
+
 /*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+/*
+ * Single producer / single consumer ring. The producer owns head, the consumer
+ * owns tail, so neither side needs a lock. One slot is always left empty to
+ * tell a full ring from an empty one. A side that has to wait publishes its
+ * task handle and the other side notifies it after moving its index.
+ * A reader may also ask to sleep until a watermark is reached or a delimiter
+ * byte arrives; the producer then only notifies it once that happens.
+ */
 typedef struct fifo_t
 {
   uint8_t* buf;              //!< buffer
@@ -30,9 +42,12 @@ typedef struct fifo_t
   uint32_t   size;             //!< size of buffer (s - 1) elements can be stored
   volatile uint32_t head;     //!< write index
   volatile uint32_t tail;     //!< read index
-  volatile uint32_t count;
-  osSemaphoreId countSem;
-  osSemaphoreId freeSem;
+  volatile TaskHandle_t reader;   //!< task blocked waiting for data, NULL if none
+  volatile TaskHandle_t writer;   //!< task blocked waiting for space, NULL if none
+  volatile uint32_t watermark;    //!< bytes the blocked reader waits for
+  volatile int32_t delimiter;     //!< byte the blocked reader waits for, FIFO_NO_DELIMITER if none
+  volatile bool delimited;        //!< delimiter seen by the producer since the reader armed
+  volatile bool cancelled;        //!< fifo_wait asked to return early
 } fifo_t;
 /*------------------------- PUBLIC VARIABLES ---------------------------------*/
 
@@ -40,13 +55,28 @@ typedef struct fifo_t
 
 /*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
 
+static uint32_t fifo_put(fifo_t *fifo, const uint8_t *buf, uint32_t nbytes);
+static uint32_t fifo_get(fifo_t *fifo, uint8_t *buf, uint32_t nbytes);
+static void fifo_wake(volatile TaskHandle_t *waiter);
+static bool fifo_block(fifo_t *fifo,
+                       volatile TaskHandle_t *waiter,
+                       uint32_t (*avail)(FifoHandle_t),
+                       TimeOut_t *timeOut,
+                       TickType_t *ticks);
+static TickType_t fifo_ticks(uint32_t timeout);
+static uint32_t fifo_contiguous_data(fifo_t *fifo);
+static uint32_t fifo_contiguous_space(fifo_t *fifo);
+static void fifo_arm_reader(fifo_t *fifo, uint32_t watermark, int32_t delimiter);
+static uint32_t fifo_readable(FifoHandle_t hfifo);
+static uint32_t fifo_waitable(FifoHandle_t hfifo);
+static void fifo_wake_reader(fifo_t *fifo, const uint8_t *data, uint32_t nbytes);
+
 /*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
 
 FifoHandle_t fifo_create(uint8_t *buf, uint32_t size)
 {
   fifo_t *newfifo = NULL;
-  int i;
-  
+
   if(size > 0)
   {
     newfifo = pvPortMalloc(sizeof(fifo_t));
@@ -57,25 +87,22 @@ FifoHandle_t fifo_create(uint8_t *buf, uint32_t size)
       newfifo->tail = 0;
       newfifo->head = 0;
       newfifo->size = size;
-      newfifo->count = 0;
-      newfifo->countSem = osSemaphoreCreate(NULL, size);
-      newfifo->freeSem = osSemaphoreCreate(NULL, size);
-      
-      /* cmsis doesn't allow semaphore to be create with initial value different than 0,
-      * initialize it to max value this way
-      */
-      for(i=0; i<size; i++)
-      {
-        osSemaphoreRelease(newfifo->freeSem);
-      }
-      
+      newfifo->reader = NULL;
+      newfifo->writer = NULL;
+      newfifo->watermark = 1;
+      newfifo->delimiter = FIFO_NO_DELIMITER;
+      newfifo->delimited = false;
+      newfifo->cancelled = false;
+
       if(buf == NULL)
       {
-        newfifo->abuf = pvPortMalloc(size);
+        /* one extra byte for the empty slot so the caller gets the full size */
+        newfifo->size = size + 1;
+        newfifo->abuf = pvPortMalloc(newfifo->size);
         if(newfifo->abuf != NULL)
         {
           newfifo->buf = newfifo->abuf;
-          memset(newfifo->buf, 0, size);
+          memset(newfifo->buf, 0, newfifo->size);
         }
         else
         {
@@ -86,7 +113,7 @@ FifoHandle_t fifo_create(uint8_t *buf, uint32_t size)
       }
     }
   }
-  
+
   return (FifoHandle_t)newfifo;
 }
 
@@ -95,14 +122,14 @@ FifoHandle_t fifo_create(uint8_t *buf, uint32_t size)
 void fifo_destroy(FifoHandle_t hfifo)
 {
   fifo_t *fifo = (fifo_t *)hfifo;
-  
+
   if(fifo != NULL)
   {
     if(fifo->abuf != NULL)
     {
       vPortFree(fifo->abuf);
     }
-    
+
     vPortFree(fifo);
   }
 }
@@ -111,42 +138,54 @@ void fifo_destroy(FifoHandle_t hfifo)
 uint32_t fifo_length(FifoHandle_t hfifo)
 {
   fifo_t *fifo = (fifo_t *)hfifo;
-  
-  return (uint32_t)uxSemaphoreGetCount(fifo->countSem);
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+
+  return (head >= tail) ? (head - tail) : (fifo->size - tail + head);
 }
 
 uint32_t fifo_free(FifoHandle_t hfifo)
 {
   fifo_t *fifo = (fifo_t *)hfifo;
-  
-  return (uint32_t)uxSemaphoreGetCount(fifo->freeSem);
+
+  return fifo->size - 1 - fifo_length(hfifo);
 }
 
 
 uint32_t fifo_write(FifoHandle_t hfifo, const uint8_t *buf, uint32_t nbytes, uint32_t timeout)
 {
   fifo_t *fifo = (fifo_t *)hfifo;
-  uint32_t n;
-  
-  for(n=0; n<nbytes; n++)
+  uint32_t n = 0;
+  uint32_t chunk;
+  TickType_t ticks = 0;
+  TimeOut_t timeOut;
+  bool waiting = false;
+
+  while(n < nbytes)
   {
-    if(osSemaphoreWait(fifo->freeSem, timeout) == osOK)
+    chunk = fifo_put(fifo, &buf[n], nbytes - n);
+    if(chunk > 0)
     {
-      fifo->count++;
-      fifo->buf[fifo->head] = buf[n];
-      fifo->head++;
-      if(fifo->head == fifo->size)
-      {
-        fifo->head = 0;
-      }
-      osSemaphoreRelease(fifo->countSem);
+      fifo_wake_reader(fifo, &buf[n], chunk);
+      n += chunk;
+      /* timeout is measured between bytes, restart it on progress */
+      waiting = false;
     }
     else
     {
-      break;
+      if(!waiting)
+      {
+        ticks = fifo_ticks(timeout);
+        vTaskSetTimeOutState(&timeOut);
+        waiting = true;
+      }
+      if(!fifo_block(fifo, &fifo->writer, fifo_free, &timeOut, &ticks))
+      {
+        break;
+      }
     }
   }
-  
+
   return n;
 }
 
@@ -154,37 +193,424 @@ uint32_t fifo_write(FifoHandle_t hfifo, const uint8_t *buf, uint32_t nbytes, uin
 uint32_t fifo_read(FifoHandle_t hfifo, uint8_t *buf, uint32_t nbytes, uint32_t timeout)
 {
   fifo_t *fifo = (fifo_t *)hfifo;
-  uint32_t n;
-  uint32_t count = 0;
-  int32_t ret;
-  bool error = false;
-  
-  for(n=0; (n<nbytes) && !error; n++)
-  {
-    ret = osSemaphoreWait(fifo->countSem, timeout);
-    if(ret == osOK)
-    {
-      fifo->count--;
-      buf[n] = fifo->buf[fifo->tail];
-      fifo->tail++;
-      if(fifo->tail == fifo->size)
+  uint32_t n = 0;
+  uint32_t chunk;
+  TickType_t ticks = 0;
+  TimeOut_t timeOut;
+  bool waiting = false;
+
+  while(n < nbytes)
+  {
+    chunk = fifo_get(fifo, &buf[n], nbytes - n);
+    if(chunk > 0)
+    {
+      n += chunk;
+      fifo_wake(&fifo->writer);
+      /* timeout is measured between bytes, restart it on progress */
+      waiting = false;
+    }
+    else
+    {
+      if(!waiting)
+      {
+        ticks = fifo_ticks(timeout);
+        vTaskSetTimeOutState(&timeOut);
+        fifo_arm_reader(fifo, 1, FIFO_NO_DELIMITER);
+        waiting = true;
+      }
+      if(!fifo_block(fifo, &fifo->reader, fifo_readable, &timeOut, &ticks))
       {
-        fifo->tail = 0;
+        break;
       }
-      osSemaphoreRelease(fifo->freeSem);
-      count++;
     }
-    else
+  }
+
+  return n;
+}
+
+
+uint32_t fifo_peek_contiguous(FifoHandle_t hfifo, const uint8_t **data, uint32_t timeout)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t n;
+  TickType_t ticks;
+  TimeOut_t timeOut;
+
+  n = fifo_contiguous_data(fifo);
+  if(n == 0)
+  {
+    ticks = fifo_ticks(timeout);
+    vTaskSetTimeOutState(&timeOut);
+    fifo_arm_reader(fifo, 1, FIFO_NO_DELIMITER);
+    if(fifo_block(fifo, &fifo->reader, fifo_readable, &timeOut, &ticks))
     {
-      error = true;
+      n = fifo_contiguous_data(fifo);
     }
   }
-  
-  return count;
+
+  FIFO_MEMORY_BARRIER();
+  *data = &fifo->buf[fifo->tail];
+
+  return n;
+}
+
+
+uint32_t fifo_contiguous(FifoHandle_t hfifo, const uint8_t **data)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t n;
+
+  n = fifo_contiguous_data(fifo);
+  FIFO_MEMORY_BARRIER();
+  *data = &fifo->buf[fifo->tail];
+
+  return n;
+}
+
+
+void fifo_consume(FifoHandle_t hfifo, uint32_t nbytes)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t tail;
+
+  if(nbytes > 0)
+  {
+    tail = fifo->tail + nbytes;
+    if(tail >= fifo->size)
+    {
+      tail -= fifo->size;
+    }
+    FIFO_MEMORY_BARRIER();
+    fifo->tail = tail;
+    fifo_wake(&fifo->writer);
+  }
+}
+
+
+uint32_t fifo_reserve(FifoHandle_t hfifo, uint8_t **data, uint32_t timeout)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t n;
+  TickType_t ticks;
+  TimeOut_t timeOut;
+
+  n = fifo_contiguous_space(fifo);
+  if(n == 0)
+  {
+    ticks = fifo_ticks(timeout);
+    vTaskSetTimeOutState(&timeOut);
+    if(fifo_block(fifo, &fifo->writer, fifo_free, &timeOut, &ticks))
+    {
+      n = fifo_contiguous_space(fifo);
+    }
+  }
+
+  *data = &fifo->buf[fifo->head];
+
+  return n;
+}
+
+
+void fifo_commit(FifoHandle_t hfifo, uint32_t nbytes)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t head;
+  const uint8_t *data;
+
+  if(nbytes > 0)
+  {
+    data = &fifo->buf[fifo->head];
+    head = fifo->head + nbytes;
+    if(head >= fifo->size)
+    {
+      head -= fifo->size;
+    }
+    FIFO_MEMORY_BARRIER();
+    fifo->head = head;
+    fifo_wake_reader(fifo, data, nbytes);
+  }
+}
+
+
+uint32_t fifo_wait(FifoHandle_t hfifo, uint32_t watermark, int32_t delimiter, uint32_t timeout)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  TickType_t ticks;
+  TimeOut_t timeOut;
+
+  if(watermark > fifo->size - 1)
+  {
+    watermark = fifo->size - 1;
+  }
+  if(watermark == 0)
+  {
+    watermark = 1;
+  }
+
+  ticks = fifo_ticks(timeout);
+  vTaskSetTimeOutState(&timeOut);
+  fifo_arm_reader(fifo, watermark, delimiter);
+  fifo_block(fifo, &fifo->reader, fifo_waitable, &timeOut, &ticks);
+  fifo->cancelled = false;
+
+  return fifo_length(hfifo);
+}
+
+
+void fifo_wait_cancel(FifoHandle_t hfifo)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+
+  fifo->cancelled = true;
+  fifo_wake(&fifo->reader);
 }
 
 /*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
 
+/* Set the wakeup condition before the reader publishes itself as waiting */
+static void fifo_arm_reader(fifo_t *fifo, uint32_t watermark, int32_t delimiter)
+{
+  fifo->watermark = watermark;
+  fifo->delimiter = delimiter;
+  fifo->delimited = false;
+  FIFO_MEMORY_BARRIER();
+}
+
+/* Reader wakeup condition: watermark reached or delimiter buffered */
+static uint32_t fifo_readable(FifoHandle_t hfifo)
+{
+  fifo_t *fifo = (fifo_t *)hfifo;
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+  int32_t delimiter = fifo->delimiter;
+
+  if(fifo->delimited || (fifo_length(hfifo) >= fifo->watermark))
+  {
+    return 1;
+  }
+
+  /* the delimiter may have arrived before the reader was published */
+  if((delimiter != FIFO_NO_DELIMITER) && (head != tail))
+  {
+    if(head > tail)
+    {
+      return memchr(&fifo->buf[tail], delimiter, head - tail) != NULL;
+    }
+    return (memchr(&fifo->buf[tail], delimiter, fifo->size - tail) != NULL) ||
+      (memchr(fifo->buf, delimiter, head) != NULL);
+  }
+
+  return 0;
+}
+
+/* fifo_wait wakeup condition: readable or cancelled */
+static uint32_t fifo_waitable(FifoHandle_t hfifo)
+{
+  return ((fifo_t *)hfifo)->cancelled || fifo_readable(hfifo);
+}
+
+/*
+ * Producer side check after new data is published: only a blocked reader
+ * whose condition is now met gets notified, so a line-oriented reader is
+ * woken once per line instead of once per byte.
+ */
+static void fifo_wake_reader(fifo_t *fifo, const uint8_t *data, uint32_t nbytes)
+{
+  int32_t delimiter;
+
+  FIFO_MEMORY_BARRIER();
+  if(fifo->reader != NULL)
+  {
+    delimiter = fifo->delimiter;
+    if((delimiter != FIFO_NO_DELIMITER) && (memchr(data, delimiter, nbytes) != NULL))
+    {
+      fifo->delimited = true;
+    }
+    if(fifo->delimited || (fifo_length((FifoHandle_t)fifo) >= fifo->watermark))
+    {
+      fifo_wake(&fifo->reader);
+    }
+  }
+}
+
+/* Buffered bytes readable from tail without wrapping */
+static uint32_t fifo_contiguous_data(fifo_t *fifo)
+{
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+
+  return (head >= tail) ? (head - tail) : (fifo->size - tail);
+}
+
+/* Free bytes writable at head without wrapping, keeping the empty slot */
+static uint32_t fifo_contiguous_space(fifo_t *fifo)
+{
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+
+  if(tail > head)
+  {
+    return tail - head - 1;
+  }
+
+  return (tail == 0) ? (fifo->size - head - 1) : (fifo->size - head);
+}
+
+/* Copy as much as fits into the ring, at most two contiguous spans. Producer only. */
+static uint32_t fifo_put(fifo_t *fifo, const uint8_t *buf, uint32_t nbytes)
+{
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+  uint32_t space;
+  uint32_t first;
+
+  space = (tail > head) ? (tail - head - 1) : (fifo->size - head + tail - 1);
+  if(nbytes > space)
+  {
+    nbytes = space;
+  }
+
+  if(nbytes > 0)
+  {
+    first = fifo->size - head;
+    if(first > nbytes)
+    {
+      first = nbytes;
+    }
+    memcpy(&fifo->buf[head], buf, first);
+    memcpy(fifo->buf, &buf[first], nbytes - first);
+
+    head += nbytes;
+    if(head >= fifo->size)
+    {
+      head -= fifo->size;
+    }
+    FIFO_MEMORY_BARRIER();
+    fifo->head = head;
+  }
+
+  return nbytes;
+}
+
+/* Copy as much as is buffered out of the ring, at most two contiguous spans. Consumer only. */
+static uint32_t fifo_get(fifo_t *fifo, uint8_t *buf, uint32_t nbytes)
+{
+  uint32_t head = fifo->head;
+  uint32_t tail = fifo->tail;
+  uint32_t count;
+  uint32_t first;
+
+  count = (head >= tail) ? (head - tail) : (fifo->size - tail + head);
+  if(nbytes > count)
+  {
+    nbytes = count;
+  }
+
+  if(nbytes > 0)
+  {
+    FIFO_MEMORY_BARRIER();
+    first = fifo->size - tail;
+    if(first > nbytes)
+    {
+      first = nbytes;
+    }
+    memcpy(buf, &fifo->buf[tail], first);
+    memcpy(&buf[first], fifo->buf, nbytes - first);
 
+    tail += nbytes;
+    if(tail >= fifo->size)
+    {
+      tail -= fifo->size;
+    }
+    FIFO_MEMORY_BARRIER();
+    fifo->tail = tail;
+  }
 
+  return nbytes;
+}
+
+/* Notify the task waiting on the other side, if any. Callable from ISR. */
+static void fifo_wake(volatile TaskHandle_t *waiter)
+{
+  TaskHandle_t task;
+  BaseType_t woken = pdFALSE;
+
+  FIFO_MEMORY_BARRIER();
+  task = *waiter;
+  if(task != NULL)
+  {
+    *waiter = NULL;
+    if(xPortIsInsideInterrupt())
+    {
+      vTaskNotifyGiveFromISR(task, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    else
+    {
+      xTaskNotifyGive(task);
+    }
+  }
+}
+
+/*
+ * Sleep until avail() reports the wait condition met or the timeout expires. The
+ * waiter is published before avail() is re-checked, so a wakeup between the
+ * check and the sleep is never lost. Stale notifications only cause another
+ * pass through the loop.
+ */
+static bool fifo_block(fifo_t *fifo,
+                       volatile TaskHandle_t *waiter,
+                       uint32_t (*avail)(FifoHandle_t),
+                       TimeOut_t *timeOut,
+                       TickType_t *ticks)
+{
+  bool ready = false;
 
+  if(xPortIsInsideInterrupt() ||
+     xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+  {
+    return false;
+  }
+
+  while(!ready)
+  {
+    *waiter = xTaskGetCurrentTaskHandle();
+    FIFO_MEMORY_BARRIER();
+    if(avail((FifoHandle_t)fifo) > 0)
+    {
+      ready = true;
+    }
+    else if(xTaskCheckForTimeOut(timeOut, ticks) != pdFALSE)
+    {
+      break;
+    }
+    else
+    {
+      ulTaskNotifyTake(pdTRUE, *ticks);
+    }
+  }
+  *waiter = NULL;
+
+  return ready;
+}
+
+/* Millisecond timeout to ticks, same rounding as the CMSIS-RTOS wrappers */
+static TickType_t fifo_ticks(uint32_t timeout)
+{
+  TickType_t ticks;
+
+  if(timeout == osWaitForever)
+  {
+    ticks = portMAX_DELAY;
+  }
+  else
+  {
+    ticks = timeout / portTICK_PERIOD_MS;
+    if((timeout != 0) && (ticks == 0))
+    {
+      ticks = 1;
+    }
+  }
+
+  return ticks;
+}
@@ -0,0 +1,43 @@
+/**
+* @file
+* @brief    FreeRTOS subset for running the AT parser on a host
+* @warning  Host builds only, never on the target include path
+* @details
+*
+* Just enough of the kernel API for ATCmdParser.c, ATRecorder.c and
+* ATReplay.c to compile and run in a single threaded Linux process,
+* see atreplay.c. Tasks cannot be created, so the AT engine and trace
+* tasks stay off.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdFAIL              pdFALSE
+#define pdPASS              pdTRUE
+
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS  ((TickType_t)1)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+
+#define pvPortMalloc        malloc
+#define vPortFree           free
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#endif /* _HOST_FREERTOS_H */
@@ -0,0 +1,195 @@
+/**
+* @file
+* @brief    Replay an AT transcript through the parser on a host
+* @warning  Host builds only
+* @details
+*
+* Feeds a log captured with atparser_recorder_log_sink through
+* ATCmdParser on the replay transport and reports how long the parser
+* took. Every recorded write is issued in order and the lines received
+* after it are read with atparser_recv, with the modem's URC prefixes
+* registered as out of band handlers, the way ssModem.c reads them. Time
+* is virtual, so the run is deterministic and timeouts cost nothing.
+*
+* Build from Middlewares/SmartSenseLib:
+*
+*   gcc -O2 -std=gnu99 -DATPARSER_TRACE_LEVEL=0 -Isrc/port/Host -Iinterface \
+*       src/port/Host/atreplay.c src/port/Host/host.c \
+*       src/Modem/ATCmdParser.c src/Modem/ATReplay.c -o atreplay
+*
+* Usage: atreplay <capture.log> [runs]
+* Exits with 1 if the parser did not read the transcript to the end.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+/*------------------------- INCLUDED FILES ************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "ATCmdParser.h"
+#include "ATTransport.h"
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+#define ATREPLAY_TIMEOUT  1000  // ms of virtual time a read may wait
+
+/*------------------------- PRIVATE VARIABLES --------------------------------*/
+
+static const char *urc_prefixes[] =
+{
+  "+CREG",
+  "+CGREG",
+  "+CEREG",
+  "+UUSORD",
+  "+UUSORF",
+  "+UUSOCL",
+};
+
+static uint32_t urc_count;
+static uint32_t line_count;
+
+/*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
+
+static void atreplay_urc(void *param)
+{
+  (void)param;
+  urc_count++;
+}
+
+static char *atreplay_read_file(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  char *text = NULL;
+  long size;
+
+  if (file == NULL)
+  {
+    return NULL;
+  }
+  if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) >= 0) &&
+      (fseek(file, 0, SEEK_SET) == 0) && ((text = malloc(size + 1)) != NULL))
+  {
+    size = fread(text, 1, size, file);
+    text[size] = 0;
+  }
+  fclose(file);
+  return text;
+}
+
+static uint64_t atreplay_cpu_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Read lines until the transcript needs the next write
+static void atreplay_drain(ATCmdParser *parser)
+{
+  while (atparser_recv(parser, "%*[^\n]\n"))
+  {
+    line_count++;
+  }
+}
+
+// One pass over the transcript, returns false if it did not replay cleanly
+static bool atreplay_run(const atparser_replay *capture, atparser_replay *replay)
+{
+  ATCmdParser *parser;
+
+  atparser_replay_init(replay, capture->records, capture->count);
+  host_set_clock(&replay->clock);
+
+  parser = atparser_create_transport(&atparser_replay_transport, replay);
+  if (parser == NULL)
+  {
+    return false;
+  }
+  atparser_set_timeout(parser, ATREPLAY_TIMEOUT);
+  for (uint32_t i = 0; i < sizeof(urc_prefixes) / sizeof(urc_prefixes[0]); i++)
+  {
+    atparser_oob(parser, urc_prefixes[i], atreplay_urc, NULL);
+  }
+
+  atreplay_drain(parser);
+  for (uint32_t i = 0; i < capture->count; i++)
+  {
+    const atparser_record *record = &capture->records[i];
+
+    if (record->dir == ATPARSER_RECORD_TX)
+    {
+      atparser_write(parser, (const char *)record->data, record->len);
+      atreplay_drain(parser);
+    }
+  }
+
+  atparser_destroy(parser);
+  host_set_clock(NULL);
+  return atparser_replay_done(replay) && (replay->mismatches == 0);
+}
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+int main(int argc, char *argv[])
+{
+  atparser_replay capture;
+  atparser_replay replay;
+  char *text;
+  int runs = 1;
+  bool clean = true;
+  uint64_t start;
+  uint64_t elapsed;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <capture.log> [runs]\n", argv[0]);
+    return 2;
+  }
+  if (argc > 2)
+  {
+    runs = atoi(argv[2]);
+  }
+
+  text = atreplay_read_file(argv[1]);
+  if (text == NULL)
+  {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  if (atparser_replay_load(&capture, text) == 0)
+  {
+    fprintf(stderr, "no ATREC records in %s\n", argv[1]);
+    free(text);
+    return 2;
+  }
+  free(text);
+
+  start = atreplay_cpu_ns();
+  for (int run = 0; run < runs; run++)
+  {
+    urc_count = 0;
+    line_count = 0;
+    clean = atreplay_run(&capture, &replay) && clean;
+  }
+  elapsed = atreplay_cpu_ns() - start;
+
+  printf("records %lu, lines %lu, urcs %lu\n",
+         (unsigned long)capture.count, (unsigned long)line_count, (unsigned long)urc_count);
+  printf("modem time %lu ms, timeouts %lu, mismatches %lu, %s\n",
+         (unsigned long)replay.clock, (unsigned long)replay.timeouts,
+         (unsigned long)replay.mismatches, atparser_replay_done(&replay) ? "complete" : "incomplete");
+  printf("parser time %.1f us per run over %d runs\n", elapsed / 1000.0 / (runs > 0 ? runs : 1), runs);
+
+  atparser_replay_free(&capture);
+  return clean ? 0 : 1;
+}
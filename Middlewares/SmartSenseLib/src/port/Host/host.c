@@ -0,0 +1,277 @@
+/**
+* @file
+* @brief    Kernel, uart and logging services for host builds
+* @warning  Host builds only
+* @details
+*
+* Single threaded stand-ins for what the AT parser uses on the target,
+* see FreeRTOS.h. Logging goes to stdout in the target's format, so AT
+* traffic recorded on a host can be replayed like a field capture.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+/*------------------------- INCLUDED FILES ************************************/
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+#include "ssUart.h"
+#include "ssLogging.h"
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+typedef struct host_queue
+{
+  uint8_t *items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+} host_queue;
+
+/*------------------------- PRIVATE VARIABLES --------------------------------*/
+
+static const uint32_t *host_clock = NULL;
+
+static const char *host_level_name[] =
+{
+  "?",
+  "D",
+  "I",
+  "W",
+  "E",
+};
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+void host_set_clock(const uint32_t *clock)
+{
+  host_clock = clock;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  struct timespec now;
+
+  if (host_clock != NULL)
+  {
+    return *host_clock;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t stack_size,
+                       void *param, UBaseType_t priority, TaskHandle_t *handle)
+{
+  (void)code;
+  (void)name;
+  (void)stack_size;
+  (void)param;
+  (void)priority;
+  (void)handle;
+  return pdFAIL;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  (void)task;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  (void)ticks;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  return NULL;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  (void)task;
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  (void)clear;
+  (void)ticks;
+  return 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  host_queue *queue = malloc(sizeof(host_queue));
+
+  if (queue != NULL)
+  {
+    queue->items = malloc(length * item_size);
+    if (queue->items == NULL)
+    {
+      free(queue);
+      return NULL;
+    }
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->head = 0;
+    queue->count = 0;
+  }
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t handle)
+{
+  host_queue *queue = (host_queue *)handle;
+
+  free(queue->items);
+  free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t ticks)
+{
+  host_queue *queue = (host_queue *)handle;
+  UBaseType_t slot;
+
+  (void)ticks;
+  if (queue->count == queue->length)
+  {
+    return pdFALSE;
+  }
+  slot = (queue->head + queue->count) % queue->length;
+  memcpy(&queue->items[slot * queue->item_size], item, queue->item_size);
+  queue->count++;
+  return pdTRUE;
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t handle, const void *item, TickType_t ticks)
+{
+  host_queue *queue = (host_queue *)handle;
+
+  (void)ticks;
+  if (queue->count == queue->length)
+  {
+    return pdFALSE;
+  }
+  queue->head = (queue->head + queue->length - 1) % queue->length;
+  memcpy(&queue->items[queue->head * queue->item_size], item, queue->item_size);
+  queue->count++;
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks)
+{
+  host_queue *queue = (host_queue *)handle;
+
+  (void)ticks;
+  if (queue->count == 0)
+  {
+    return pdFALSE;
+  }
+  memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  return pdTRUE;
+}
+
+uint32_t ssUartWritev(uint32_t id, const struct iovec *iov, uint32_t count)
+{
+  uint32_t total = 0;
+
+  (void)id;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+uint32_t ssUartPeek(uint32_t id, const uint8_t **data, uint32_t timeout)
+{
+  (void)id;
+  (void)timeout;
+  *data = NULL;
+  return 0;
+}
+
+void ssUartConsume(uint32_t id, uint32_t size)
+{
+  (void)id;
+  (void)size;
+}
+
+void ssLoggingPrint(const ESsLoggingLevel level,
+                    const uint32_t category,
+                    const char* unformattedStringPtr,
+                    ...)
+{
+  va_list args;
+
+  (void)category;
+  if (!(level > ESsLoggingLevel_NotValid && level < ESsLoggingLevel_NoPrints))
+  {
+    return;
+  }
+  printf("[%s] ", host_level_name[level]);
+  va_start(args, unformattedStringPtr);
+  vprintf(unformattedStringPtr, args);
+  va_end(args);
+  printf("\r\n");
+}
+
+// Same escaping as the target, see ssLogging.c
+void ssLoggingPrintRawStr(const ESsLoggingLevel level,
+                          const uint32_t category,
+                          const char* string,
+                          int len,
+                          const char* unformattedStringPtr,
+                          ...)
+{
+  va_list args;
+
+  (void)category;
+  if (!(level > ESsLoggingLevel_NotValid && level < ESsLoggingLevel_NoPrints))
+  {
+    return;
+  }
+  printf("[%s] ", host_level_name[level]);
+  va_start(args, unformattedStringPtr);
+  vprintf(unformattedStringPtr, args);
+  va_end(args);
+
+  printf(" %3d \"", len);
+  while (len--)
+  {
+    char ch = *string++;
+    if ((ch > 0x1F) && (ch < 0x7F))
+    {
+      if      (ch == '"')  printf("\\\"");
+      else if (ch == '\\') printf("\\\\");
+      else printf("%c", ch);
+    }
+    else
+    {
+      if      (ch == '\a') printf("\\a");
+      else if (ch == '\b') printf("\\b");
+      else if (ch == '\t') printf("\\t");
+      else if (ch == '\n') printf("\\n");
+      else if (ch == '\v') printf("\\v");
+      else if (ch == '\f') printf("\\f");
+      else if (ch == '\r') printf("\\r");
+      else                 printf("\\x%02x", (unsigned char)ch);
+    }
+  }
+  printf("\"\r\n");
+}
@@ -0,0 +1,29 @@
+/**
+* @file
+* @brief    FreeRTOS queue API subset for host builds, see FreeRTOS.h
+* @warning
+* @details
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+#ifndef _HOST_QUEUE_H
+#define _HOST_QUEUE_H
+
+#include "FreeRTOS.h"
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+typedef void *QueueHandle_t;
+
+/*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
+
+/* Plain copying rings, nothing ever blocks */
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+
+#endif /* _HOST_QUEUE_H */
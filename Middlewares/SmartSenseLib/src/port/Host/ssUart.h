@@ -0,0 +1,27 @@
+/**
+* @file
+* @brief    Uart API used by the AT parser, host builds
+* @warning
+* @details
+*
+* Shadows interface/ssUart.h, which needs the HAL. There is no uart on a
+* host: the calls behave like an idle line, a parser runs on another
+* transport such as atparser_replay_transport.
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+#ifndef _HOST_SS_UART_H
+#define _HOST_SS_UART_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
+
+uint32_t ssUartWritev(uint32_t id, const struct iovec *iov, uint32_t count);
+uint32_t ssUartPeek(uint32_t id, const uint8_t **data, uint32_t timeout);
+void ssUartConsume(uint32_t id, uint32_t size);
+
+#endif /* _HOST_SS_UART_H */
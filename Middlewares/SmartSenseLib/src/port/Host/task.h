@@ -0,0 +1,36 @@
+/**
+* @file
+* @brief    FreeRTOS task API subset for host builds, see FreeRTOS.h
+* @warning
+* @details
+*
+* Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+*
+**/
+
+#ifndef _HOST_TASK_H
+#define _HOST_TASK_H
+
+#include "FreeRTOS.h"
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+/*------------------------- PUBLIC FUNCTION PROTOTYPES -----------------------*/
+
+/* Milliseconds of the clock set with host_set_clock, host time by default */
+TickType_t xTaskGetTickCount(void);
+void host_set_clock(const uint32_t *clock);
+
+/* There is one thread: creating a task fails, waiting returns at once */
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t stack_size,
+                       void *param, UBaseType_t priority, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+#endif /* _HOST_TASK_H */
@@ -133,6 +133,7 @@ void ssCliUartConsoleInit(void)
   config.Parity = CLI_UART_PARITY;
   config.StopBits = CLI_UART_STOPBITS;
   config.WordLength = CLI_UART_WORDLENGTH;
+  config.DmaMode = SS_UART_DMA_NONE;
   
   cliUart = ssUartOpen(CLI_UART, &config, CLI_USART_BUFFER_SIZE);
   configASSERT(cliUart >= 0);
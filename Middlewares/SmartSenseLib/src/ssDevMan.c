@@ -25,6 +25,7 @@
 #include "FreeRTOS.h"
 #include "cmsis_os.h"
 #include "ATCmdParser.h"
+#include "fifo.h"
 
 #include "ssModemWrapper.h"
 
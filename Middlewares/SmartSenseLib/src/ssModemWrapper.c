@@ -25,6 +25,7 @@
 #include "assert.h"
 #include "ssDevMan.h"
 #include "ATCmdParser.h"
+#include "fifo.h"
 #include "ssModem.h"
 #include "ssModemWrapper.h"
 
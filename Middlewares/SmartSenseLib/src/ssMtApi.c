@@ -93,6 +93,7 @@ void ssMtApiInit(void)
   config.Parity = MTAPI_UART_PARITY;
   config.StopBits = MTAPI_UART_STOPBITS;
   config.WordLength = MTAPI_UART_WORDLENGTH;
+  config.DmaMode = SS_UART_DMA_NONE;
   mt_uart = ssUartOpen(MTAPI_UART, &config, MTAPI_USART_BUFFER_SIZE);
   configASSERT(mt_uart >= 0);
   
@@ -120,67 +121,95 @@ uint32_t crc_err=0;
 uint8_t *MtApiFrameReceive(uint32_t timeout)
 {
   uint8_t c;
-  uint8_t cmdlen = 0;
+  uint32_t cmdlen = 0;
   uint8_t fcs;
-  uint8_t cmdidx = 0;
+  uint32_t cmdidx = 0;
   uint8_t *cmd = NULL;
   uint32_t done = 0;
   uint32_t state = MT_RCV_STATE_SOF;
   uint32_t i;
+  const uint8_t *data;
+  const uint8_t *sof;
+  uint32_t n;
+  uint32_t used;
+  uint32_t chunk;
   (void)timeout; /* not used */
   
   /* MT command format:
    *          | SOP | Data Length  |   CMD   |   Data   |  FCS  |
    *          |  1  |     1        |    2    |  0-Len   |   1   |
+   *
+   * Frames are parsed in place from the uart rx fifo, a span at a time.
    */
   do
   {
-    c = ssUartGetc(mt_uart, portMAX_DELAY);
+    n = ssUartPeek(mt_uart, &data, portMAX_DELAY);
+    used = 0;
     
-    switch(state)
+    while((used < n) && !done)
     {
-    case MT_RCV_STATE_SOF:
-      if(c == MT_FRAME_SOF)
-      {
-        state = MT_RCV_STATE_LEN;
-      }
-      break;
-    case MT_RCV_STATE_LEN:
-      cmdlen = c + MT_FRAME_CMD_SIZE + MT_FRAME_LEN_SIZE;
-      cmd = pvPortMalloc(cmdlen);
-      if(cmd != NULL)
-      {
-        cmdidx = 0;
-        cmd[cmdidx++] = c;
-        state = MT_RCV_STATE_CMD;
-      }
-      else
+      switch(state)
       {
+      case MT_RCV_STATE_SOF:
+        sof = memchr(&data[used], MT_FRAME_SOF, n - used);
+        if(sof != NULL)
+        {
+          used = (sof - data) + 1;
+          state = MT_RCV_STATE_LEN;
+        }
+        else
+        {
+          used = n;
+        }
+        break;
+      case MT_RCV_STATE_LEN:
+        c = data[used++];
+        cmdlen = c + MT_FRAME_CMD_SIZE + MT_FRAME_LEN_SIZE;
+        cmd = pvPortMalloc(cmdlen);
+        if(cmd != NULL)
+        {
+          cmdidx = 0;
+          cmd[cmdidx++] = c;
+          state = MT_RCV_STATE_CMD;
+        }
+        else
+        {
+          done = 1;
+        }
+        break;
+      case MT_RCV_STATE_CMD:
+        chunk = cmdlen - cmdidx;
+        if(chunk > n - used)
+        {
+          chunk = n - used;
+        }
+        memcpy(&cmd[cmdidx], &data[used], chunk);
+        cmdidx += chunk;
+        used += chunk;
+        if(cmdidx == cmdlen)
+        {
+          state = MT_RCV_STATE_FCS;
+        }
+        break;
+      case MT_RCV_STATE_FCS:
+        c = data[used++];
+        fcs = 0;
+        for(i=0; i< cmdlen; i++)
+        {
+          fcs ^= cmd[i];
+        }
+        if((fcs ^ c) != 0)
+        {
+          /* checksum error; discard received data */
+          vPortFree(cmd);
+          cmd = NULL;
+          crc_err++;
+        }
         done = 1;
       }
-      break;
-    case MT_RCV_STATE_CMD:
-      cmd[cmdidx++] = c;
-      if(cmdidx == cmdlen)
-      {
-        state = MT_RCV_STATE_FCS;
-      }
-      break;
-    case MT_RCV_STATE_FCS:
-      fcs = 0;
-      for(i=0; i< cmdlen; i++)
-      {
-        fcs ^= cmd[i];
-      }
-      if((fcs ^ c) != 0)
-      {
-        /* checksum error; discard received data */
-        vPortFree(cmd);
-        cmd = NULL;
-        crc_err++;
-      }
-      done = 1;
     }
+    
+    ssUartConsume(mt_uart, used);
   } while(!done);
   
   return cmd;
@@ -322,23 +351,25 @@ void MtApiSendCmdReqMsgHandle(void *msg)
 
 void MtApiFrameSend(const uint8_t *const cmd)
 {
+  static const uint8_t sof = MT_FRAME_SOF;
   uint8_t fcs = 0;
-  uint8_t i;
-
-  ssUartPutc(mt_uart, MT_FRAME_SOF);
-  ssUartPutc(mt_uart, cmd[MT_CMD_LEN_POS]);
-  fcs ^= cmd[MT_CMD_LEN_POS];
-  ssUartPutc(mt_uart, cmd[MT_CMD_CMD0_POS]);
-  fcs ^= cmd[MT_CMD_CMD0_POS];
-  ssUartPutc(mt_uart, cmd[MT_CMD_CMD1_POS]);
-  fcs ^= cmd[MT_CMD_CMD1_POS];
-  
-  for(i=0; i<cmd[MT_CMD_LEN_POS]; i++)
+  uint32_t len = MT_CMD_DATA_POS + cmd[MT_CMD_LEN_POS];
+  uint32_t i;
+  struct iovec frame[3];
+
+  /* fcs covers length, command and data, which follow each other in cmd */
+  for(i=0; i<len; i++)
   {
-    ssUartPutc(mt_uart, cmd[MT_CMD_DATA_POS+i]);
-    fcs ^= cmd[MT_CMD_DATA_POS+i];
+    fcs ^= cmd[i];
   }
-  ssUartPutc(mt_uart, fcs);
+
+  frame[0].iov_base = (void *)&sof;
+  frame[0].iov_len = MT_FRAME_SOF_SIZE;
+  frame[1].iov_base = (void *)cmd;
+  frame[1].iov_len = len;
+  frame[2].iov_base = &fcs;
+  frame[2].iov_len = 1;
+  ssUartWritev(mt_uart, frame, 3);
 }
 
 void MtApiReceiverTask(void * argument)
@@ -9,9 +9,13 @@
  **/
 
 /*------------------------- INCLUDED FILES ************************************/
+#include <stdbool.h>
+#include <string.h>
+
 #include "FreeRTOS.h"
 #include "task.h"
 #include "queue.h"
+#include "semphr.h"
 
 #include "ssUart.h"
 #include "fifo.h"
@@ -19,16 +23,40 @@
 /*------------------------- MACRO DEFINITIONS --------------------------------*/
 
 #define USART_FIFO_USED
+
+/* longest wait for pending tx data before the line is reconfigured [ms] */
+#define SS_UART_DRAIN_TIMEOUT   1000
   
 /*------------------------- TYPE DEFINITIONS ---------------------------------*/
 
 typedef struct
 {
   USART_TypeDef* usart;
+  ssUartConfigType config;
   FifoHandle_t rxfifo;
   FifoHandle_t txfifo;
-  uint32_t rx_dropped;
+  SemaphoreHandle_t txlock;
+  ssUartStatsType stats;
+  uint32_t irq_last_count;
+  TickType_t irq_last_tick;
+  DMA_HandleTypeDef *rxdma;
+  uint8_t *rxdmabuf;
+  uint32_t rxdmapos;
+  DMA_HandleTypeDef *txdma;
+  volatile uint32_t txdmalen;
 } ssUartType;
+
+/* uart peripherals with an interrupt handler in this file */
+typedef enum
+{
+  SS_UART_PORT_USART1 = 0,
+  SS_UART_PORT_USART2,
+  SS_UART_PORT_USART3,
+  SS_UART_PORT_UART5,
+  SS_UART_PORT_USART6,
+  SS_UART_PORT_UART7,
+  SS_UART_PORT_COUNT
+} ssUartPortType;
   
 /*------------------------- PUBLIC VARIABLES ---------------------------------*/
 
@@ -37,9 +65,25 @@ typedef struct
 ssUartType *m_uarts = NULL;
 uint32_t m_uart_count = 0;
 
+/* open slot per peripheral, so interrupt handlers need no search */
+static ssUartType *m_uart_ports[SS_UART_PORT_COUNT] = {NULL};
+
 /*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
 
-void ssUartInterrupt(USART_TypeDef* USARTx);
+void ssUartInterrupt(ssUartPortType port);
+void ssUartRxDmaInterrupt(ssUartPortType port);
+void ssUartTxDmaInterrupt(ssUartPortType port);
+static int32_t ssUartPortIndex(USART_TypeDef* USARTx);
+static bool ssUartRxDmaStart(ssUartType *uart);
+static void ssUartRxDmaPublish(ssUartType *uart);
+static void ssUartRxPush(ssUartType *uart, const uint8_t *data, uint32_t size);
+static void ssUartTxDmaInit(ssUartType *uart);
+static void ssUartTxStart(ssUartType *uart);
+static void ssUartFillHandle(UART_HandleTypeDef *handle, USART_TypeDef* USARTx, ssUartConfigType *config);
+static bool ssUartTxDrain(ssUartType *uart, uint32_t timeout);
+static uint32_t ssUartTxQueue(ssUartType *uart, const uint8_t *s, uint32_t size);
+static bool ssUartTxLock(ssUartType *uart);
+static void ssUartTxUnlock(ssUartType *uart);
 
 
 /*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
@@ -57,6 +101,8 @@ uint32_t ssUartInit(uint32_t uart_count)
   for(i=0U; i<uart_count; i++)
   {
     m_uarts[i].usart = NULL;
+    m_uarts[i].rxdma = NULL;
+    m_uarts[i].txdma = NULL;
     //m_uarts[i].rx_queue = NULL;
     //m_uarts[i].tx_queue = NULL;
   }
@@ -72,6 +118,14 @@ int32_t ssUartOpen(USART_TypeDef* USARTx,
   UART_HandleTypeDef UARTHandle = {0};
   uint32_t i;
   int32_t id = -1;
+  int32_t port;
+  
+  port = ssUartPortIndex(USARTx);
+  if(port < 0)
+  {
+    /* no interrupt handler for this peripheral */
+    goto ssUartOpen_err_0;
+  }
   
   /* find free slot */
   for(i=0U; i<m_uart_count; i++)
@@ -106,45 +160,60 @@ int32_t ssUartOpen(USART_TypeDef* USARTx,
   {
     goto ssUartOpen_err_2;
   }
-  m_uarts[id].rx_dropped = 0;
+  m_uarts[id].txlock = xSemaphoreCreateMutex();
+  if(m_uarts[id].txlock == NULL)
+  {
+    goto ssUartOpen_err_3;
+  }
+  memset(&m_uarts[id].stats, 0, sizeof(ssUartStatsType));
+  m_uarts[id].stats.buffer_size = buffer_size;
+  m_uarts[id].irq_last_count = 0;
+  m_uarts[id].irq_last_tick = xTaskGetTickCount();
+  m_uarts[id].config = *config;
  
   /* Fill default settings */
-  UARTHandle.Instance = USARTx;
-  UARTHandle.Init.BaudRate = config->baudrate;
-  UARTHandle.Init.HwFlowCtl = config->FlowControl;
-  UARTHandle.Init.Mode = config->Mode;
-  UARTHandle.Init.Parity = config->Parity;
-  UARTHandle.Init.StopBits = config->StopBits;
-  UARTHandle.Init.WordLength = config->WordLength;
-  UARTHandle.Init.OverSampling = UART_OVERSAMPLING_16;
-#if defined(STM32F303xE) || defined(STM32L4PLUS)
-  UARTHandle.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
-  UARTHandle.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
-#endif 
-
+  ssUartFillHandle(&UARTHandle, USARTx, config);
 
   if(HAL_UART_Init(&UARTHandle) != HAL_OK)
   {
-    goto ssUartOpen_err_3;
+    goto ssUartOpen_err_4;
   }
   
 #if defined(STM32L4PLUS)
   if (HAL_UARTEx_SetTxFifoThreshold(&UARTHandle, UART_TXFIFO_THRESHOLD_1_8) != HAL_OK)
   {
-    goto ssUartOpen_err_4;
+    goto ssUartOpen_err_5;
   }
 
   if (HAL_UARTEx_SetRxFifoThreshold(&UARTHandle, UART_RXFIFO_THRESHOLD_1_8) != HAL_OK)
   {
-    goto ssUartOpen_err_4;
+    goto ssUartOpen_err_5;
   }
 
   if (HAL_UARTEx_DisableFifoMode(&UARTHandle) != HAL_OK)
   {
-    goto ssUartOpen_err_4;
+    goto ssUartOpen_err_5;
   }
 #endif
 
+  m_uarts[id].rxdma = NULL;
+  m_uarts[id].txdma = NULL;
+  m_uarts[id].txdmalen = 0;
+  m_uart_ports[port] = &m_uarts[id];
+  if((config->DmaMode & SS_UART_DMA_TX) != 0)
+  {
+    /* leaves txdma NULL (TXE interrupts) if there is no stream for this uart */
+    ssUartTxDmaInit(&m_uarts[id]);
+  }
+
+  if(((config->DmaMode & SS_UART_DMA_RX) != 0) && ssUartRxDmaStart(&m_uarts[id]))
+  {
+    /* bytes are moved by the dma, uart only signals the idle line and errors */
+    USARTx->CR1 |= USART_CR1_IDLEIE;
+    USARTx->CR3 |= USART_CR3_EIE;
+    return id;
+  }
+
   /* Enable RX interrupt */
 #if defined(STM32L4PLUS)
   USARTx->CR1 |= USART_CR1_RXNEIE_RXFNEIE;
@@ -154,9 +223,11 @@ int32_t ssUartOpen(USART_TypeDef* USARTx,
   return id;
   
 #if defined(STM32L4PLUS)
-ssUartOpen_err_4:
+ssUartOpen_err_5:
   HAL_UART_DeInit(&UARTHandle);
 #endif
+ssUartOpen_err_4:
+  vSemaphoreDelete(m_uarts[id].txlock);
 ssUartOpen_err_3:
   fifo_destroy(m_uarts[id].txfifo);
 ssUartOpen_err_2:
@@ -184,55 +255,46 @@ uint8_t ssUartGetc(uint32_t id, uint32_t timeout)
 
 uint32_t ssUartGets(uint32_t id, uint8_t *s, uint32_t size, uint32_t timeout)
 {
-  uint32_t i;
-  uint8_t c = 0;
-  TickType_t ticksOld;
-  TickType_t ticksNow;
-  TickType_t ticksDelta;
-  TickType_t delta;
-   
-  if(timeout != portMAX_DELAY)
-  {
-    ticksOld = xTaskGetTickCount();
-    for(i=0; i<size-1; i++)
+  uint32_t i = 0;
+  uint32_t n;
+  uint32_t len;
+  const uint8_t *data;
+  bool done = false;
+
+  /* sleep until a whole line (or a full buffer) is there, then scan the
+   * rx fifo in place, copying whole spans up to the line end */
+  while(!done && (i < size - 1))
+  {
+    if(fifo_wait(m_uarts[id].rxfifo, size - 1 - i, '\n', timeout) == 0)
     {
-      ticksNow = xTaskGetTickCount();
-      ticksDelta = ticksNow - ticksOld;
-      ticksOld = ticksNow;
-      delta = OS_TICKS_TO_MILLISECONDS(ticksDelta);
-      if(timeout > delta)
-      {
-        c = ssUartGetc(id, timeout);
-        if(c == 0 || c == '\n')
-        {
-          break;
-        }
-        else
-        {
-          *s = c;
-          s++;
-        }
-      }
+      /* nothing received */
+      break;
     }
-  }
-  else
-  {
-    for(i=0; i<size-1; i++)
+    n = fifo_peek_contiguous(m_uarts[id].rxfifo, &data, 0);
+    if(n > size - 1 - i)
     {
-      c = ssUartGetc(id, timeout);
-      if(c == 0 || c == '\n')
-      {
-        break;
-      }
-      else
-      {
-        *s = c;
-        s++;
-      }
+      n = size - 1 - i;
+    }
+
+    for(len = 0; (len < n) && (data[len] != '\n') && (data[len] != 0); len++)
+    {
+    }
+    memcpy(&s[i], data, len);
+    i += len;
+
+    if(len < n)
+    {
+      /* drop the terminator as well */
+      fifo_consume(m_uarts[id].rxfifo, len + 1);
+      done = true;
+    }
+    else
+    {
+      fifo_consume(m_uarts[id].rxfifo, len);
     }
   }
   /* terminate string */
-  *s = '\0';
+  s[i] = '\0';
   
   return i;
 }
@@ -256,18 +318,47 @@ uint8_t ssUartPuts(uint32_t id, const char *s)
 }
 
 uint32_t ssUartWrite(uint32_t id, const uint8_t *s, const uint32_t size)
+{
+  uint32_t nbytes;
+  bool locked;
+
+  if(id >= m_uart_count)
+  {
+    return 0;
+  }
+  
+  locked = ssUartTxLock(&m_uarts[id]);
+  nbytes = ssUartTxQueue(&m_uarts[id], s, size);
+  ssUartTxStart(&m_uarts[id]);
+  if(locked)
+  {
+    ssUartTxUnlock(&m_uarts[id]);
+  }
+
+  return nbytes;
+}
+
+
+uint32_t ssUartWritev(uint32_t id, const struct iovec *iov, uint32_t count)
 {
   uint32_t nbytes = 0;
+  uint32_t i;
+  bool locked;
 
   if(id >= m_uart_count)
   {
     return 0;
   }
   
-  while(size > nbytes)
+  locked = ssUartTxLock(&m_uarts[id]);
+  for(i=0; i<count; i++)
+  {
+    nbytes += ssUartTxQueue(&m_uarts[id], (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+  }
+  ssUartTxStart(&m_uarts[id]);
+  if(locked)
   {
-    nbytes += fifo_write(m_uarts[id].txfifo, &s[nbytes], size - nbytes, 0);
-    BSP_UART_START_TX(m_uarts[id].usart);
+    ssUartTxUnlock(&m_uarts[id]);
   }
 
   return nbytes;
@@ -288,38 +379,193 @@ uint32_t ssUartRead(uint32_t id, uint8_t *s, const uint32_t size, uint32_t timeo
 }
 
 
+uint32_t ssUartPeek(uint32_t id, const uint8_t **data, uint32_t timeout)
+{
+  if(id >= m_uart_count)
+  {
+    return 0;
+  }
+
+  return fifo_peek_contiguous(m_uarts[id].rxfifo, data, timeout);
+}
+
+
+uint32_t ssUartWait(uint32_t id, uint32_t watermark, int32_t delimiter, uint32_t timeout)
+{
+  if(id >= m_uart_count)
+  {
+    return 0;
+  }
+
+  return fifo_wait(m_uarts[id].rxfifo, watermark, delimiter, timeout);
+}
+
+
+void ssUartWaitCancel(uint32_t id)
+{
+  if(id < m_uart_count)
+  {
+    fifo_wait_cancel(m_uarts[id].rxfifo);
+  }
+}
+
+
+void ssUartConsume(uint32_t id, uint32_t size)
+{
+  if(id < m_uart_count)
+  {
+    fifo_consume(m_uarts[id].rxfifo, size);
+  }
+}
+
+
+uint32_t ssUartSetBaudrate(uint32_t id, uint32_t baudrate)
+{
+  UART_HandleTypeDef UARTHandle = {0};
+
+  if((id >= m_uart_count) || (m_uarts[id].usart == NULL))
+  {
+    return DDAL_UART_ERR;
+  }
+
+  /* let queued bytes leave at the old rate */
+  if(!ssUartTxDrain(&m_uarts[id], SS_UART_DRAIN_TIMEOUT))
+  {
+    return DDAL_UART_ERR;
+  }
+
+  /* HAL_UART_Init keeps the interrupt and dma enable bits, fifos are untouched */
+  m_uarts[id].config.baudrate = baudrate;
+  ssUartFillHandle(&UARTHandle, m_uarts[id].usart, &m_uarts[id].config);
+  if(HAL_UART_Init(&UARTHandle) != HAL_OK)
+  {
+    return DDAL_UART_ERR;
+  }
+
+  return DDAL_UART_OK;
+}
+
+
+uint32_t ssUartClose(uint32_t id)
+{
+  UART_HandleTypeDef UARTHandle = {0};
+  ssUartType *uart;
+  UBaseType_t isrMask;
+  int32_t port;
+
+  if((id >= m_uart_count) || (m_uarts[id].usart == NULL))
+  {
+    return DDAL_UART_ERR;
+  }
+  uart = &m_uarts[id];
+
+  /* best effort, whatever is still queued after the timeout is dropped */
+  (void)ssUartTxDrain(uart, SS_UART_DRAIN_TIMEOUT);
+
+  /* silence the port before its memory goes away */
+  isrMask = taskENTER_CRITICAL_FROM_ISR();
+  CLEAR_BIT(uart->usart->CR1, USART_CR1_RXNEIE | USART_CR1_TXEIE | USART_CR1_TCIE | USART_CR1_IDLEIE);
+  CLEAR_BIT(uart->usart->CR3, USART_CR3_EIE);
+  BSP_UART_STOP_RX_DMA(uart->usart);
+  BSP_UART_STOP_TX_DMA(uart->usart);
+  port = ssUartPortIndex(uart->usart);
+  if(port >= 0)
+  {
+    m_uart_ports[port] = NULL;
+  }
+  taskEXIT_CRITICAL_FROM_ISR(isrMask);
+
+  if(uart->rxdma != NULL)
+  {
+    HAL_DMA_Abort(uart->rxdma);
+    HAL_DMA_DeInit(uart->rxdma);
+    vPortFree(uart->rxdmabuf);
+    vPortFree(uart->rxdma);
+    uart->rxdma = NULL;
+  }
+  if(uart->txdma != NULL)
+  {
+    HAL_DMA_Abort(uart->txdma);
+    HAL_DMA_DeInit(uart->txdma);
+    vPortFree(uart->txdma);
+    uart->txdma = NULL;
+  }
+  uart->txdmalen = 0;
+
+  UARTHandle.Instance = uart->usart;
+  HAL_UART_DeInit(&UARTHandle);
+
+  fifo_destroy(uart->txfifo);
+  fifo_destroy(uart->rxfifo);
+  vSemaphoreDelete(uart->txlock);
+  uart->txfifo = NULL;
+  uart->rxfifo = NULL;
+  uart->txlock = NULL;
+
+  /* slot is free for ssUartOpen again */
+  uart->usart = NULL;
+
+  return DDAL_UART_OK;
+}
+
+
+uint32_t ssUartGetStats(uint32_t id, ssUartStatsType *stats)
+{
+  TickType_t now;
+  uint32_t irqs;
+
+  if((id >= m_uart_count) || (m_uarts[id].usart == NULL))
+  {
+    return DDAL_UART_ERR;
+  }
+
+  *stats = m_uarts[id].stats;
+
+  now = xTaskGetTickCount();
+  irqs = stats->irq_count - m_uarts[id].irq_last_count;
+  if(now != m_uarts[id].irq_last_tick)
+  {
+    stats->irq_per_sec = (uint32_t)(((uint64_t)irqs * configTICK_RATE_HZ) / (now - m_uarts[id].irq_last_tick));
+  }
+  m_uarts[id].irq_last_count = stats->irq_count;
+  m_uarts[id].irq_last_tick = now;
+
+  return DDAL_UART_OK;
+}
+
+
 
 /**
 * @brief This function handles USART1 global interrupt.
 */
 void USART1_IRQHandler(void)
 {
-  ssUartInterrupt(USART1);
+  ssUartInterrupt(SS_UART_PORT_USART1);
 }
 
 void USART2_IRQHandler(void)
 {
-  ssUartInterrupt(USART2);
+  ssUartInterrupt(SS_UART_PORT_USART2);
 }
 
 #if BSP_UART3_ENABLED == BSP_ON
 void USART3_IRQHandler(void)
 {
-  ssUartInterrupt(USART3);
+  ssUartInterrupt(SS_UART_PORT_USART3);
 }
 #endif
 
 #if defined(BSP_USART3_ENABLED)
 void USART3_IRQHandler(void)
 {
-  ssUartInterrupt(USART3);
+  ssUartInterrupt(SS_UART_PORT_USART3);
 }
 #endif
 
 #if defined(BSP_USART6_ENABLED)
 void USART6_IRQHandler(void)
 {
-  ssUartInterrupt(USART6);
+  ssUartInterrupt(SS_UART_PORT_USART6);
 }
 #endif
 
@@ -327,49 +573,120 @@ void USART6_IRQHandler(void)
 #if defined(BSP_UART5_ENABLED)
 void UART5_IRQHandler(void)
 {
-  ssUartInterrupt(UART5);
+  ssUartInterrupt(SS_UART_PORT_UART5);
 }
 #endif
 
 #if defined(BSP_UART7_ENABLED)
 void UART7_IRQHandler(void)
 {
-  ssUartInterrupt(UART7);
+  ssUartInterrupt(SS_UART_PORT_UART7);
+}
+#endif
+
+#if defined(BSP_USART1_RX_DMA_IRQHandler)
+void BSP_USART1_RX_DMA_IRQHandler(void)
+{
+  ssUartRxDmaInterrupt(SS_UART_PORT_USART1);
+}
+#endif
+
+#if defined(BSP_USART3_RX_DMA_IRQHandler)
+void BSP_USART3_RX_DMA_IRQHandler(void)
+{
+  ssUartRxDmaInterrupt(SS_UART_PORT_USART3);
+}
+#endif
+
+#if defined(BSP_USART6_RX_DMA_IRQHandler)
+void BSP_USART6_RX_DMA_IRQHandler(void)
+{
+  ssUartRxDmaInterrupt(SS_UART_PORT_USART6);
+}
+#endif
+
+#if defined(BSP_UART7_RX_DMA_IRQHandler)
+void BSP_UART7_RX_DMA_IRQHandler(void)
+{
+  ssUartRxDmaInterrupt(SS_UART_PORT_UART7);
+}
+#endif
+
+#if defined(BSP_USART1_TX_DMA_IRQHandler)
+void BSP_USART1_TX_DMA_IRQHandler(void)
+{
+  ssUartTxDmaInterrupt(SS_UART_PORT_USART1);
+}
+#endif
+
+#if defined(BSP_USART3_TX_DMA_IRQHandler)
+void BSP_USART3_TX_DMA_IRQHandler(void)
+{
+  ssUartTxDmaInterrupt(SS_UART_PORT_USART3);
+}
+#endif
+
+#if defined(BSP_USART6_TX_DMA_IRQHandler)
+void BSP_USART6_TX_DMA_IRQHandler(void)
+{
+  ssUartTxDmaInterrupt(SS_UART_PORT_USART6);
 }
 #endif
 
 /*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
 
-void ssUartInterrupt(USART_TypeDef* USARTx)
+void ssUartInterrupt(ssUartPortType port)
 {
-  uint32_t i;
-  int32_t id = -1;
+  ssUartType *uart = m_uart_ports[port];
+  USART_TypeDef* USARTx;
+  uint32_t err;
   uint8_t c;
-  
-  /* find the uart id */
-  for(i=0; i<m_uart_count; i++)
+    
+  if(uart != NULL)
   {
-    if(m_uarts[i].usart == USARTx)
+    USARTx = uart->usart;
+    uart->stats.irq_count++;
+    
+    /* error flags are cleared by the DR read below */
+    err = BSP_USART_ERR_INT(USARTx);
+    if(err != 0)
     {
-      id = i;
-      break;
+      if(err & USART_SR_ORE)
+      {
+        uart->stats.overrun_errors++;
+      }
+      if(err & USART_SR_FE)
+      {
+        uart->stats.framing_errors++;
+      }
+      if(err & USART_SR_NE)
+      {
+        uart->stats.noise_errors++;
+      }
     }
-  }
     
-  if(id != -1)
-  {
-    if(BSP_USART_RX_INT(USARTx)) 
+    if((uart->rxdma != NULL) && READ_BIT(USARTx->CR3, USART_CR3_DMAR))
+    {
+      if(BSP_USART_IDLE_INT(USARTx) || (err != 0))
+      {
+        /* SR then DR read clears the idle/error flags; flush the partial burst */
+        (void)BSP_USART_READ_DATA(USARTx);
+        ssUartRxDmaPublish(uart);
+      }
+    }
+    else if(BSP_USART_RX_INT(USARTx)) 
     {
       /* received byte */
       c = BSP_USART_READ_DATA(USARTx);
-      fifo_write(m_uarts[id].rxfifo, &c, 1, 0);
+      ssUartRxPush(uart, &c, 1);
     }      
-    if(BSP_USART_TX_INT(USARTx))
+    if((uart->txdma == NULL) && BSP_USART_TX_INT(USARTx))
     {
       /* uart data register is empty, we can send new byte if available */
-      if(fifo_read(m_uarts[id].txfifo, &c, 1, 0) == 1)
+      if(fifo_read(uart->txfifo, &c, 1, 0) == 1)
       {
         BSP_USART_WRITE_DATA(USARTx, c);
+        uart->stats.tx_bytes++;
       }
       else
       {
@@ -381,4 +698,465 @@ void ssUartInterrupt(USART_TypeDef* USARTx)
 }
 
 
+void ssUartRxDmaInterrupt(ssUartPortType port)
+{
+  ssUartType *uart = m_uart_ports[port];
+  
+  if((uart != NULL) && (uart->rxdma != NULL))
+  {
+    uart->stats.irq_count++;
+    HAL_DMA_IRQHandler(uart->rxdma);
+  }
+}
+
+
+void ssUartTxDmaInterrupt(ssUartPortType port)
+{
+  ssUartType *uart = m_uart_ports[port];
+  
+  if((uart != NULL) && (uart->txdma != NULL))
+  {
+    uart->stats.irq_count++;
+    HAL_DMA_IRQHandler(uart->txdma);
+  }
+}
+
 
+static int32_t ssUartPortIndex(USART_TypeDef* USARTx)
+{
+  if(USARTx == USART1)
+  {
+    return SS_UART_PORT_USART1;
+  }
+  if(USARTx == USART2)
+  {
+    return SS_UART_PORT_USART2;
+  }
+#if defined(USART3)
+  if(USARTx == USART3)
+  {
+    return SS_UART_PORT_USART3;
+  }
+#endif
+#if defined(UART5)
+  if(USARTx == UART5)
+  {
+    return SS_UART_PORT_UART5;
+  }
+#endif
+#if defined(USART6)
+  if(USARTx == USART6)
+  {
+    return SS_UART_PORT_USART6;
+  }
+#endif
+#if defined(UART7)
+  if(USARTx == UART7)
+  {
+    return SS_UART_PORT_UART7;
+  }
+#endif
+  return -1;
+}
+
+
+static void ssUartRxDmaCallback(DMA_HandleTypeDef *hdma)
+{
+  ssUartRxDmaPublish((ssUartType *)hdma->Parent);
+}
+
+
+static void ssUartRxDmaErrorCallback(DMA_HandleTypeDef *hdma)
+{
+  ssUartType *uart = (ssUartType *)hdma->Parent;
+
+  /* fifo and direct mode errors leave the circular stream running */
+  if((hdma->ErrorCode & HAL_DMA_ERROR_TE) == 0)
+  {
+    return;
+  }
+
+  /* transfer error disabled the stream, hand over what we have and rearm */
+  ssUartRxDmaPublish(uart);
+  uart->rxdmapos = 0;
+  if(HAL_DMA_Start_IT(hdma, (uint32_t)&uart->usart->DR, (uint32_t)uart->rxdmabuf, SS_UART_DMA_RX_BUFFER_SIZE) != HAL_OK)
+  {
+    /* stream is gone, keep receiving on rx interrupts */
+    BSP_UART_STOP_RX_DMA(uart->usart);
+    CLEAR_BIT(uart->usart->CR1, USART_CR1_IDLEIE);
+    SET_BIT(uart->usart->CR1, USART_CR1_RXNEIE);
+  }
+}
+
+
+static bool ssUartRxDmaLookup(USART_TypeDef* USARTx, DMA_Stream_TypeDef **stream, uint32_t *channel)
+{
+#if defined(BSP_USART1_RX_DMA_STREAM)
+  if(USARTx == USART1)
+  {
+    *stream = BSP_USART1_RX_DMA_STREAM;
+    *channel = BSP_USART1_RX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+#if defined(BSP_USART3_RX_DMA_STREAM)
+  if(USARTx == USART3)
+  {
+    *stream = BSP_USART3_RX_DMA_STREAM;
+    *channel = BSP_USART3_RX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+#if defined(BSP_USART6_RX_DMA_STREAM)
+  if(USARTx == USART6)
+  {
+    *stream = BSP_USART6_RX_DMA_STREAM;
+    *channel = BSP_USART6_RX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+#if defined(BSP_UART7_RX_DMA_STREAM)
+  if(USARTx == UART7)
+  {
+    *stream = BSP_UART7_RX_DMA_STREAM;
+    *channel = BSP_UART7_RX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+  return false;
+}
+
+
+static bool ssUartRxDmaStart(ssUartType *uart)
+{
+  DMA_Stream_TypeDef *stream;
+  uint32_t channel;
+  
+  if(!ssUartRxDmaLookup(uart->usart, &stream, &channel))
+  {
+    /* no stream wired to this uart, stay on rx interrupts */
+    goto ssUartRxDmaStart_err_0;
+  }
+  
+  uart->rxdma = pvPortMalloc(sizeof(DMA_HandleTypeDef));
+  if(uart->rxdma == NULL)
+  {
+    goto ssUartRxDmaStart_err_0;
+  }
+  uart->rxdmabuf = pvPortMalloc(SS_UART_DMA_RX_BUFFER_SIZE);
+  if(uart->rxdmabuf == NULL)
+  {
+    goto ssUartRxDmaStart_err_1;
+  }
+  
+  memset(uart->rxdma, 0, sizeof(DMA_HandleTypeDef));
+  uart->rxdma->Instance = stream;
+  uart->rxdma->Init.Channel = channel;
+  uart->rxdma->Init.Direction = DMA_PERIPH_TO_MEMORY;
+  uart->rxdma->Init.PeriphInc = DMA_PINC_DISABLE;
+  uart->rxdma->Init.MemInc = DMA_MINC_ENABLE;
+  uart->rxdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  uart->rxdma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  uart->rxdma->Init.Mode = DMA_CIRCULAR;
+  uart->rxdma->Init.Priority = DMA_PRIORITY_HIGH;
+  uart->rxdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  
+  if(HAL_DMA_Init(uart->rxdma) != HAL_OK)
+  {
+    goto ssUartRxDmaStart_err_2;
+  }
+  
+  uart->rxdma->Parent = uart;
+  uart->rxdma->XferHalfCpltCallback = ssUartRxDmaCallback;
+  uart->rxdma->XferCpltCallback = ssUartRxDmaCallback;
+  uart->rxdma->XferErrorCallback = ssUartRxDmaErrorCallback;
+  uart->rxdmapos = 0;
+  
+  if(HAL_DMA_Start_IT(uart->rxdma, (uint32_t)&uart->usart->DR, (uint32_t)uart->rxdmabuf, SS_UART_DMA_RX_BUFFER_SIZE) != HAL_OK)
+  {
+    goto ssUartRxDmaStart_err_3;
+  }
+  BSP_UART_START_RX_DMA(uart->usart);
+  
+  return true;
+  
+ssUartRxDmaStart_err_3:
+  HAL_DMA_DeInit(uart->rxdma);
+ssUartRxDmaStart_err_2:
+  vPortFree(uart->rxdmabuf);
+ssUartRxDmaStart_err_1:
+  vPortFree(uart->rxdma);
+  uart->rxdma = NULL;
+ssUartRxDmaStart_err_0:
+  return false;
+}
+
+
+static void ssUartRxDmaPublish(ssUartType *uart)
+{
+  uint32_t pos;
+  uint32_t n;
+  
+  /* NDTR counts down from the buffer size and reloads in circular mode */
+  pos = SS_UART_DMA_RX_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(uart->rxdma);
+  if(pos >= SS_UART_DMA_RX_BUFFER_SIZE)
+  {
+    pos = 0;
+  }
+  
+  if(pos < uart->rxdmapos)
+  {
+    /* dma wrapped, flush the end of the buffer first */
+    n = SS_UART_DMA_RX_BUFFER_SIZE - uart->rxdmapos;
+    ssUartRxPush(uart, &uart->rxdmabuf[uart->rxdmapos], n);
+    uart->rxdmapos = 0;
+  }
+  if(pos > uart->rxdmapos)
+  {
+    n = pos - uart->rxdmapos;
+    ssUartRxPush(uart, &uart->rxdmabuf[uart->rxdmapos], n);
+  }
+  uart->rxdmapos = pos;
+}
+
+
+static void ssUartFillHandle(UART_HandleTypeDef *handle, USART_TypeDef* USARTx, ssUartConfigType *config)
+{
+  handle->Instance = USARTx;
+  handle->Init.BaudRate = config->baudrate;
+  handle->Init.HwFlowCtl = config->FlowControl;
+  handle->Init.Mode = config->Mode;
+  handle->Init.Parity = config->Parity;
+  handle->Init.StopBits = config->StopBits;
+  handle->Init.WordLength = config->WordLength;
+  handle->Init.OverSampling = UART_OVERSAMPLING_16;
+#if defined(STM32F303xE) || defined(STM32L4PLUS)
+  handle->Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
+  handle->AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
+#endif 
+}
+
+
+/* Wait until the tx fifo is empty and the last frame has left the shift register */
+static bool ssUartTxDrain(ssUartType *uart, uint32_t timeout)
+{
+  TickType_t start = xTaskGetTickCount();
+
+  while((fifo_length(uart->txfifo) != 0) || (uart->txdmalen != 0) ||
+        ((uart->usart->SR & USART_SR_TC) == 0))
+  {
+    if((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout))
+    {
+      return false;
+    }
+    vTaskDelay(1);
+  }
+
+  return true;
+}
+
+
+/*
+ * Copy size bytes into the tx fifo. The transmitter is only kicked when the
+ * fifo fills up, the caller kicks it once at the end.
+ */
+static uint32_t ssUartTxQueue(ssUartType *uart, const uint8_t *s, uint32_t size)
+{
+  uint32_t nbytes = 0;
+  uint32_t n;
+  uint8_t *space;
+
+  while(size > nbytes)
+  {
+    n = fifo_write(uart->txfifo, &s[nbytes], size - nbytes, 0);
+    nbytes += n;
+    if(fifo_length(uart->txfifo) > uart->stats.tx_peak)
+    {
+      uart->stats.tx_peak = fifo_length(uart->txfifo);
+    }
+    if(n == 0)
+    {
+      /* fifo is full, sleep until the transmitter frees some space
+       * (returns at once from an ISR or before the scheduler runs) */
+      ssUartTxStart(uart);
+      fifo_reserve(uart->txfifo, &space, portMAX_DELAY);
+    }
+  }
+
+  return nbytes;
+}
+
+
+/* Serialise task writers; ISRs and early boot code write unlocked */
+static bool ssUartTxLock(ssUartType *uart)
+{
+  if(xPortIsInsideInterrupt() ||
+     xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+  {
+    return false;
+  }
+
+  xSemaphoreTake(uart->txlock, portMAX_DELAY);
+  return true;
+}
+
+
+static void ssUartTxUnlock(ssUartType *uart)
+{
+  xSemaphoreGive(uart->txlock);
+}
+
+
+/* Hand received bytes to the rx fifo, keeping the statistics. ISR only. */
+static void ssUartRxPush(ssUartType *uart, const uint8_t *data, uint32_t size)
+{
+  uint32_t n;
+  uint32_t length;
+
+  n = fifo_write(uart->rxfifo, data, size, 0);
+  uart->stats.rx_bytes += size;
+  uart->stats.rx_dropped += size - n;
+
+  length = fifo_length(uart->rxfifo);
+  if(length > uart->stats.rx_peak)
+  {
+    uart->stats.rx_peak = length;
+  }
+}
+
+
+static void ssUartTxDmaCallback(DMA_HandleTypeDef *hdma)
+{
+  ssUartType *uart = (ssUartType *)hdma->Parent;
+
+  /* burst is out, release it and send the next one */
+  fifo_consume(uart->txfifo, uart->txdmalen);
+  uart->stats.tx_bytes += uart->txdmalen;
+  uart->txdmalen = 0;
+  ssUartTxStart(uart);
+}
+
+
+static void ssUartTxDmaErrorCallback(DMA_HandleTypeDef *hdma)
+{
+  ssUartType *uart = (ssUartType *)hdma->Parent;
+  uint32_t sent;
+
+  /* fifo and direct mode errors leave the stream running, its TC follows */
+  if((hdma->ErrorCode & HAL_DMA_ERROR_TE) == 0)
+  {
+    return;
+  }
+
+  /* transfer error disabled the stream: release what went out, resend the rest */
+  sent = uart->txdmalen - __HAL_DMA_GET_COUNTER(hdma);
+  fifo_consume(uart->txfifo, sent);
+  uart->stats.tx_bytes += sent;
+  uart->txdmalen = 0;
+  ssUartTxStart(uart);
+}
+
+
+static bool ssUartTxDmaLookup(USART_TypeDef* USARTx, DMA_Stream_TypeDef **stream, uint32_t *channel)
+{
+#if defined(BSP_USART1_TX_DMA_STREAM)
+  if(USARTx == USART1)
+  {
+    *stream = BSP_USART1_TX_DMA_STREAM;
+    *channel = BSP_USART1_TX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+#if defined(BSP_USART3_TX_DMA_STREAM)
+  if(USARTx == USART3)
+  {
+    *stream = BSP_USART3_TX_DMA_STREAM;
+    *channel = BSP_USART3_TX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+#if defined(BSP_USART6_TX_DMA_STREAM)
+  if(USARTx == USART6)
+  {
+    *stream = BSP_USART6_TX_DMA_STREAM;
+    *channel = BSP_USART6_TX_DMA_CHANNEL;
+    return true;
+  }
+#endif
+  return false;
+}
+
+
+static void ssUartTxDmaInit(ssUartType *uart)
+{
+  DMA_Stream_TypeDef *stream;
+  uint32_t channel;
+  DMA_HandleTypeDef *hdma;
+  
+  if(!ssUartTxDmaLookup(uart->usart, &stream, &channel))
+  {
+    return;
+  }
+  
+  hdma = pvPortMalloc(sizeof(DMA_HandleTypeDef));
+  if(hdma == NULL)
+  {
+    return;
+  }
+  
+  memset(hdma, 0, sizeof(DMA_HandleTypeDef));
+  hdma->Instance = stream;
+  hdma->Init.Channel = channel;
+  hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma->Init.MemInc = DMA_MINC_ENABLE;
+  hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma->Init.Mode = DMA_NORMAL;
+  hdma->Init.Priority = DMA_PRIORITY_MEDIUM;
+  hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  
+  if(HAL_DMA_Init(hdma) != HAL_OK)
+  {
+    vPortFree(hdma);
+    return;
+  }
+  
+  hdma->Parent = uart;
+  hdma->XferCpltCallback = ssUartTxDmaCallback;
+  hdma->XferErrorCallback = ssUartTxDmaErrorCallback;
+  uart->txdmalen = 0;
+  uart->txdma = hdma;
+  BSP_UART_START_TX_DMA(uart->usart);
+}
+
+
+/*
+ * Kick the transmitter. In dma mode the longest contiguous fifo span goes out
+ * in one transfer and the transfer complete interrupt chains the next one.
+ * Called from tasks and from the dma interrupt, hence the interrupt mask.
+ */
+static void ssUartTxStart(ssUartType *uart)
+{
+  UBaseType_t isrMask;
+  const uint8_t *data;
+  uint32_t n;
+  
+  if(uart->txdma == NULL)
+  {
+    BSP_UART_START_TX(uart->usart);
+    return;
+  }
+  
+  isrMask = taskENTER_CRITICAL_FROM_ISR();
+  if(uart->txdmalen == 0)
+  {
+    n = fifo_contiguous(uart->txfifo, &data);
+    if((n > 0) &&
+       (HAL_DMA_Start_IT(uart->txdma, (uint32_t)data, (uint32_t)&uart->usart->DR, n) == HAL_OK))
+    {
+      uart->txdmalen = n;
+    }
+  }
+  taskEXIT_CRITICAL_FROM_ISR(isrMask);
+}
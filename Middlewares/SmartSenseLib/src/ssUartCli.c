@@ -0,0 +1,176 @@
+/**
+ * @file     
+ * @brief    
+ * @warning
+ * @details
+ *
+ * Copyright (c) Smart Sense d.o.o 2016. All rights reserved.
+ *
+ **/
+
+/*------------------------- INCLUDED FILES ************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "FreeRTOS_CLI.h"
+#include "ssCli.h"
+#include "ssUart.h"
+#include "ssUartCli.h"
+
+/*------------------------- MACRO DEFINITIONS --------------------------------*/
+
+/* lines printed per uart by "uart stats" */
+#define UART_CLI_STATS_LINES    3
+
+/*------------------------- TYPE DEFINITIONS ---------------------------------*/
+
+/*------------------------- PUBLIC VARIABLES ---------------------------------*/
+
+/*------------------------- PRIVATE VARIABLES --------------------------------*/
+
+static const char uartCliCommandHelpString[] =
+"Uart subcommands:\n\r"
+"- help: prints this message\n\r"
+"- stats: prints traffic and error counters of the open uarts\n\r";
+
+/*------------------------- PRIVATE FUNCTION PROTOTYPES ----------------------*/
+
+static BaseType_t UartCliCommand(char *writeBuffer, size_t size, const char *command, const BaseType_t intr);
+static BaseType_t UartCliCommandHelp(char *writeBuffer, size_t size, const char *command, const BaseType_t intr);
+static BaseType_t UartCliCommandStats(char *writeBuffer, size_t size, const char *command, const BaseType_t intr);
+
+/*------------------------- PRIVATE VARIABLES (2) ----------------------------*/
+
+static const CLI_Command_Definition_t uartCmdDesc =
+{
+  "uart",
+  "uart: uart related commands.\r\n",
+  UartCliCommand,
+  -1
+};
+
+
+/*------------------------- PUBLIC FUNCTION DEFINITIONS ----------------------*/
+
+void ssUartCliInit(void)
+{
+  configASSERT(FreeRTOS_CLIRegisterCommand(&uartCmdDesc) == pdPASS);
+}
+
+
+/*------------------------- PRIVATE FUNCTION DEFINITIONS ---------------------*/
+
+/* CLI commands */
+static BaseType_t UartCliCommand(char *writeBuffer, size_t size, const char *command, const BaseType_t intr)
+{
+  int8_t paramCnt;
+  BaseType_t status = pdFALSE;
+
+  configASSERT(writeBuffer);
+
+  paramCnt = FreeRTOS_GetNumberOfParameters(command);
+
+  if(paramCnt == 0)
+  {
+    /* No subcommand */
+    strncpy(writeBuffer, cliSubcommandErrStr, size - 1);
+    writeBuffer[size - 1] = '\0';
+    status = pdFALSE;
+  }
+  else
+  {
+    const char *subcommand = NULL;
+    BaseType_t subcommandLen;
+
+    subcommand = FreeRTOS_CLIGetParameter(command, 1, &subcommandLen);
+
+    if(strncmp(subcommand, "help", subcommandLen) == 0)
+    {
+      status = UartCliCommandHelp(writeBuffer, size, NULL, intr);
+    }
+    else if(strncmp(subcommand, "stats", subcommandLen) == 0)
+    {
+      status = UartCliCommandStats(writeBuffer, size, subcommand, intr);
+    }
+    else
+    {
+      snprintf(writeBuffer, size-1, "Unknown subcommand\n\r");
+      writeBuffer[size-1] = '\0';
+      status = pdFALSE;
+    }
+  }
+  return status;
+}
+
+static BaseType_t UartCliCommandHelp(char *writeBuffer, size_t size, const char *command, const BaseType_t intr)
+{
+  strncpy(writeBuffer, uartCliCommandHelpString, size - 1);
+  writeBuffer[size - 1] = '\0';
+  return pdFALSE;
+}
+
+/* One line per call, the CLI output buffer is small */
+static BaseType_t UartCliCommandStats(char *writeBuffer, size_t size, const char *command, const BaseType_t intr)
+{
+  static uint32_t uartId = 0;
+  static uint32_t line = 0;
+  static ssUartStatsType stats;
+
+  writeBuffer[0] = '\0';
+
+  if(line == 0)
+  {
+    /* skip slots that are not open */
+    while((uartId < BSP_UART_COUNT) && (ssUartGetStats(uartId, &stats) != DDAL_UART_OK))
+    {
+      uartId++;
+    }
+    if(uartId == BSP_UART_COUNT)
+    {
+      uartId = 0;
+      return pdFALSE;
+    }
+  }
+
+  switch(line)
+  {
+    case 0:
+      snprintf(writeBuffer, size - 1, "uart%lu: rx %lu tx %lu bytes, %lu irq/s\n\r",
+               uartId, stats.rx_bytes, stats.tx_bytes, stats.irq_per_sec);
+      break;
+    case 1:
+      snprintf(writeBuffer, size - 1, "  ore %lu fe %lu ne %lu dropped %lu\n\r",
+               stats.overrun_errors, stats.framing_errors, stats.noise_errors, stats.rx_dropped);
+      break;
+    default:
+      snprintf(writeBuffer, size - 1, "  fifo peak rx %lu/%lu tx %lu/%lu\n\r",
+               stats.rx_peak, stats.buffer_size, stats.tx_peak, stats.buffer_size);
+      break;
+  }
+  writeBuffer[size - 1] = '\0';
+
+  line++;
+  if(line == UART_CLI_STATS_LINES)
+  {
+    line = 0;
+    uartId++;
+  }
+
+  /* called again until the last open uart is printed */
+  return pdTRUE;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+ 
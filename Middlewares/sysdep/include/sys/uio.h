@@ -0,0 +1,17 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SYS_UIO_H
+#define __SYS_UIO_H
+
+
+#include <stddef.h>
+
+
+/* Buffer descriptor for scatter/gather I/O.  */
+struct iovec
+{
+  void *iov_base;	/* Start of the buffer.  */
+  size_t iov_len;	/* Length of the buffer.  */
+};
+
+
+#endif /* __SYS_UIO_H */
@@ -162,6 +162,7 @@ void stdio_init(void)
   config.Parity = UART_PARITY_NONE;
   config.StopBits = UART_STOPBITS_1;
   config.WordLength = UART_WORDLENGTH_8B;
+  config.DmaMode = SS_UART_DMA_TX;
   
   stdout_uart_handle = ssUartOpen(STDOUT_UART, &config, STDOUT_USART_BUFFER_SIZE);
   configASSERT(stdout_uart_handle >= 0);
@@ -59,6 +59,7 @@
 #include "bsp.h"
 #include "ssUart.h"
 #include "ssCli.h"
+#include "ssUartCli.h"
 #include "CliCommonCmds.h"
 #include "ssSysCom.h"
 #include "ssSupervision.h"
@@ -131,6 +132,7 @@ static bool modem_attach();
 static void modem_start();
 static int modem_all();
 static void send_cmd_modem(char* , char);
+static bool modem_run_start_script();
 static void read_wind();
 static void read_water();
 static void read_dht();
@@ -162,6 +164,7 @@ int main(void)
   ssLoggingPrint(ESsLoggingLevel_Info, 0, "%s running on %s, version %s, built %s by %s", app_name, board_name, build_version, build_date, build_author);
   ssLoggingPrint(ESsLoggingLevel_Info, 0, "Initializing tasks...");
   ssCliUartConsoleInit();
+  ssUartCliInit();
   
   /* start CLI console */
   //ssCliUartConsoleStart();
@@ -206,6 +209,7 @@ void stdio_init(void)
   config.Parity = UART_PARITY_NONE;
   config.StopBits = UART_STOPBITS_1;
   config.WordLength = UART_WORDLENGTH_8B;
+  config.DmaMode = SS_UART_DMA_TX;
   
   stdout_uart_handle = ssUartOpen(STDOUT_UART, &config, STDOUT_USART_BUFFER_SIZE);
   configASSERT(stdout_uart_handle >= 0);
@@ -324,6 +328,7 @@ static void modem_init()
   config.WordLength = UART_WORDLENGTH_8B;
   config.baudrate = 115200;
   config.FlowControl = UART_HWCONTROL_RTS_CTS;
+  config.DmaMode = SS_UART_DMA_RX | SS_UART_DMA_TX;
   modem_uart_handle = ssUartOpen(USART3, &config, 1024);
   configASSERT(modem_uart_handle >= 0);
 
@@ -451,26 +456,45 @@ static void send_cmd_modem(char* cmd, char reicv)
 
 
 }
+/* Network and socket bring-up, sent back to back; the settings-only
+ * commands share a command line */
+static const atparser_step modem_start_script[] =
+{
+	{ "AT",                                       NULL, NULL, 0,     2, 100,  0 },
+	{ "AT+CPIN?",                                 NULL, NULL, 0,     5, 1000, 0 },
+	{ "AT+CREG?",                                 NULL, NULL, 0,     0, 0,    ATPARSER_STEP_OPTIONAL },
+	{ "AT+CREG=1",                                NULL, NULL, 0,     0, 0,    ATPARSER_STEP_CONCAT },
+	{ "AT+CGDCONT=1,\"IP\",\"internet.tele2.hr\"", NULL, NULL, 0,     0, 0,    0 },
+	{ "AT+CREG?",                                 NULL, NULL, 0,     0, 0,    ATPARSER_STEP_OPTIONAL },
+	{ "AT+CGACT=1",                               NULL, NULL, 30000, 1, 1000, 0 },
+	{ "AT+CGPADDR=1",                             NULL, NULL, 0,     0, 0,    ATPARSER_STEP_OPTIONAL },
+	{ "AT+upsd=0,1,\"hologram\"",                 NULL, NULL, 0,     0, 0,    0 },
+	{ "AT+upsda=0,3",                             NULL, NULL, 30000, 1, 1000, 0 },
+	{ "AT+usocr=17,1000",                         NULL, NULL, 0,     0, 0,    0 },
+};
+
+static bool modem_run_start_script()
+{
+	int count = sizeof(modem_start_script) / sizeof(modem_start_script[0]);
+	int done = atparser_run_script(modem_parser_handle, modem_start_script, count);
+
+	if(done != count)
+	{
+		ssLoggingPrint(ESsLoggingLevel_Warning, 0, "Modem start script stopped at %s", modem_start_script[done].cmd);
+	}
+	return done == count;
+}
+
 static void modem_start(){
 	 modem_init();
 	 if(modem_attach()){
-		char cmd_AT[][50] = {"AT","AT+CPIN?","AT+CREG?","AT+CREG=1", "AT+CREG?", "AT+CGDCONT=1,\"IP\",\"internet.tele2.hr\"", "AT+CGACT=1", "AT+CGPADDR=1", "AT+upsd=0,1,\"hologram\"", "AT+upsda=0,3", "AT+usocr=17,1000"};
-		for(int i = 0; i < 11; i += 1){
-			//ssLoggingPrint(ESsLoggingLevel_Info, 0, "454545");
-			//ssLoggingPrint(ESsLoggingLevel_Info, 0, cmd_AT[i]);
-			send_cmd_modem(cmd_AT[i],'A');
-		}
+		modem_run_start_script();
 	 }
 }
 static int modem_all(){
 	 modem_init();
 	 if(modem_attach()){
-		char cmd_AT[][50] = {"AT","AT+CPIN?","AT+CREG?","AT+CREG=1", "AT+CREG?", "AT+CGDCONT=1,\"IP\",\"internet.tele2.hr\"", "AT+CGACT=1", "AT+CGPADDR=1", "AT+upsd=0,1,\"hologram\"", "AT+upsda=0,3", "AT+usocr=17,1000"};
-		for(int i = 0; i < 11; i += 1){
-			//ssLoggingPrint(ESsLoggingLevel_Info, 0, "454545");
-			//ssLoggingPrint(ESsLoggingLevel_Info, 0, cmd_AT[i]);
-			send_cmd_modem(cmd_AT[i],'A');
-		}
+		modem_run_start_script();
 		for(;;){
 			char finalData[100];
 			char part1[35] = "AT+USOST=0,\"142.93.104.222\",9000,";